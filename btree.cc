@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
+#include <sched.h>
 #include "btree.h"
 #include <math.h>
 
@@ -28,28 +32,53 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
 		       SIZE_T valuesize,
 		       BufferCache *cache,
-		       bool unique) 
+		       bool unique,
+		       SIZE_T options) 
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=options;
+  superblock_dirty=false;
+  nodeops=GetBTreeNodeOps(keysize,valuesize);
+  underflow=BTREE_UNDERFLOW_FILL;
+  splitpolicy=BTREE_SPLIT_EAGER;
+  appendsplit=false;
+  topdown=false;
+  concurrent=false;
+  optimistic=false;
   buffercache=cache;
   // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  superblock_dirty=false;
+  nodeops=GetBTreeNodeOps(0,0);
+  underflow=BTREE_UNDERFLOW_FILL;
+  splitpolicy=BTREE_SPLIT_EAGER;
+  appendsplit=false;
+  topdown=false;
+  concurrent=false;
+  optimistic=false;
 }
 
 
 //
 // Note, will not attach!
 //
-BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
+BTreeIndex::BTreeIndex(const BTreeIndex &rhs) : nodecache(rhs.nodecache), latches(rhs.latches)
 {
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  superblock_dirty=rhs.superblock_dirty;
+  nodeops=rhs.nodeops;
+  underflow=rhs.underflow;
+  splitpolicy=rhs.splitpolicy;
+  appendsplit=rhs.appendsplit;
+  topdown=rhs.topdown;
+  concurrent=rhs.concurrent;
+  optimistic=rhs.optimistic;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -64,23 +93,88 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+//
+// Distance from block y to block x as the disk model sees it: cylinder
+// hops dominate, and within a cylinder it is how many sectors the disk
+// turns past from y to x (see DiskSystem::ModelAccess), so the block
+// just after y is nearest and the one just before it furthest
+//
+static SIZE_T PlacementDistance(const BufferCache *b, const SIZE_T x, const SIZE_T y)
+{
+  SIZE_T blockspertrack = b->GetBlocksPerTrack();
+  SIZE_T blockspercylinder = b->GetNumHeads()*blockspertrack;
+  SIZE_T cx = x/blockspercylinder;
+  SIZE_T cy = y/blockspercylinder;
+  SIZE_T cylinderhop = cx>cy ? cx-cy : cy-cx;
+  SIZE_T sectorhop = (x%blockspertrack + blockspertrack - y%blockspertrack) % blockspertrack;
+
+  return cylinderhop*b->GetNumBlocks() + sectorhop;
+}
+
+
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const SIZE_T near)
 {
+  ERROR_T rc;
+  BTreeNode node;
+  SIZE_T prev, cur, best, bestprev, bestnext;
+  SIZE_T blockspercylinder;
+  lock_guard<mutex> hold(superblock_lock);
+
   n=superblock.info.freelist;
 
   if (n==0) { 
     return ERROR_NOSPACE;
   }
 
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
+  //Walk a bounded prefix of the free list looking for the block
+  //nearest to the hint, stopping at the first one on its cylinder
+  prev=0;
+  cur=n;
+  best=0;
+  bestprev=0;
+  bestnext=0;
+  blockspercylinder=buffercache->GetNumHeads()*buffercache->GetBlocksPerTrack();
+  for (SIZE_T depth=0; cur!=0 && depth<BTREE_ALLOC_SEARCH_DEPTH; depth++) {
+    //The head has to be read to take it off the list anyway; past it,
+    //a block not in the cache would cost a read to look at, more than
+    //placing the node well saves
+    if (depth>0 && !buffercache->IsBlockCached(cur)) {
+      break;
+    }
+    if ((rc = node.Unserialize(buffercache,cur))) return rc;
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
-  superblock.info.freelist=node.info.freelist;
+    if (best==0 || 
+	PlacementDistance(buffercache,cur,near)<PlacementDistance(buffercache,best,near)) { 
+      best=cur;
+      bestprev=prev;
+      bestnext=node.info.freelist;
+    }
+    if (near==0 || cur/blockspercylinder==near/blockspercylinder) {
+      break;
+    }
+    prev=cur;
+    cur=node.info.freelist;
+  }
 
-  superblock.Serialize(buffercache,superblock_index);
+  n=best;
+
+  //Unlink the chosen block from the free list, writing the link
+  //through to disk: the caller is about to make n a live node, and
+  //if n reached disk first, a crash would leave the on-disk list
+  //handing it out again
+  if (bestprev==0) { 
+    superblock.info.freelist=bestnext;
+    if ((rc = superblock.Serialize(buffercache,superblock_index)) ||
+	(rc = buffercache->FlushBlock(superblock_index))) return rc;
+    superblock_dirty=false;
+  } else {
+    if ((rc = node.Unserialize(buffercache,bestprev))) return rc;
+    node.info.freelist=bestnext;
+    if ((rc = node.Serialize(buffercache,bestprev)) ||
+	(rc = buffercache->FlushBlock(bestprev))) return rc;
+  }
 
   buffercache->NotifyAllocateBlock(n);
 
@@ -91,6 +185,7 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
   BTreeNode node;
+  lock_guard<mutex> hold(superblock_lock);
 
   node.Unserialize(buffercache,n);
 
@@ -100,11 +195,14 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
   node.info.freelist=superblock.info.freelist;
 
+  //Written through, so that a superblock written out later never
+  //names a free block that is still live on disk
   node.Serialize(buffercache,n);
+  buffercache->FlushBlock(n);
 
   superblock.info.freelist=n;
 
-  superblock.Serialize(buffercache,superblock_index);
+  superblock_dirty=true;
 
   buffercache->NotifyDeallocateBlock(n);
 
@@ -112,6 +210,55 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
 }
 
+ERROR_T BTreeIndex::InitNode(const SIZE_T n, const int nodetype, const SIZE_T format)
+{
+  BTreeNode node(nodetype,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize());
+
+  if (superblock.info.format & BTREE_OPT_BLINK) { 
+    node.info.highkeyroom=superblock.info.keysize;
+  }
+  node.View().Clear(format);
+
+  return node.Serialize(buffercache,n);
+}
+
+
+SIZE_T BTreeIndex::GetNodeFormat(const int nodetype) const
+{
+  SIZE_T options=superblock.info.format;
+
+  if (options & BTREE_OPT_VARLEN) { 
+    return BTREE_FORMAT_SLOTTED;
+  }
+  if (nodetype!=BTREE_LEAF_NODE && (options & BTREE_OPT_TRUNCATE)) { 
+    return BTREE_FORMAT_SLOTTED;
+  }
+  if (nodetype!=BTREE_LEAF_NODE && (options & BTREE_OPT_SOA)) { 
+    return BTREE_FORMAT_SOA;
+  }
+  return (options & BTREE_OPT_PREFIX) ? BTREE_FORMAT_PREFIX : BTREE_FORMAT_CLASSIC;
+}
+
+
+SIZE_T GetIndexOption(const string &name)
+{
+  return name=="PREFIX" ? BTREE_OPT_PREFIX :
+         name=="TRUNCATE" ? BTREE_OPT_TRUNCATE :
+         name=="VARLEN" ? BTREE_OPT_VARLEN :
+         name=="INTKEYS" ? BTREE_OPT_INTKEYS :
+         name=="UINTKEYS" ? BTREE_OPT_UINTKEYS :
+         name=="SOA" ? BTREE_OPT_SOA :
+         name=="LAZYDELETE" ? BTREE_OPT_LAZYDELETE :
+         name=="SPLITFULL" ? BTREE_OPT_SPLITFULL :
+         name=="BSTAR" ? BTREE_OPT_BSTAR :
+         name=="APPENDSPLIT" ? BTREE_OPT_APPENDSPLIT :
+         name=="TOPDOWN" ? BTREE_OPT_TOPDOWN :
+         name=="BLINK" ? BTREE_OPT_BLINK : 0;
+}
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -120,6 +267,12 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   assert(superblock_index==0);
 
   if (create) {
+    // Integer keys are always 8 bytes
+    if ((superblock.info.format & (BTREE_OPT_INTKEYS|BTREE_OPT_UINTKEYS)) &&
+	superblock.info.keysize!=8) { 
+      return ERROR_SIZE;
+    }
+
     // build a super block, root node, and a free space list
     //
     // Superblock at superblock_index
@@ -132,6 +285,7 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     newsuperblock.info.rootnode=superblock_index+1;
     newsuperblock.info.freelist=superblock_index+2;
     newsuperblock.info.numkeys=0;
+    newsuperblock.info.format=superblock.info.format;
 
     buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -148,6 +302,10 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     newrootnode.info.rootnode=superblock_index+1;
     newrootnode.info.freelist=superblock_index+2;
     newrootnode.info.numkeys=0;
+    if (superblock.info.format & BTREE_OPT_BLINK) { 
+      newrootnode.info.highkeyroom=superblock.info.keysize;
+    }
+    newrootnode.View().Clear(GetNodeFormat(BTREE_ROOT_NODE));
 
     buffercache->NotifyAllocateBlock(superblock_index+1);
 
@@ -176,107 +334,165 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
 
-  return superblock.Unserialize(buffercache,initblock);
+  superblock_dirty=false;
+
+  if ((rc = superblock.Unserialize(buffercache,initblock))) return rc;
+
+  // and picking the node search code that matches its shape
+  nodeops=GetBTreeNodeOps(superblock.info.keysize,superblock.info.valuesize);
+
+  if (superblock.info.format & BTREE_OPT_LAZYDELETE) {
+    underflow=0;
+  }
+  if (superblock.info.format & BTREE_OPT_SPLITFULL) {
+    splitpolicy=BTREE_SPLIT_FULL;
+  }
+  if (superblock.info.format & BTREE_OPT_BSTAR) {
+    splitpolicy=BTREE_SPLIT_BSTAR;
+  }
+  if (superblock.info.format & BTREE_OPT_APPENDSPLIT) {
+    appendsplit=true;
+  }
+  if (superblock.info.format & BTREE_OPT_TOPDOWN) {
+    topdown=true;
+  }
+
+  // Interior nodes are decoded from here on
+  nodecache.Attach(buffercache,superblock.info.keysize,BTREE_NODECACHE_SIZE);
+
+  // and any block can be latched
+  latches.Resize(buffercache->GetNumBlocks());
+
+  return ERROR_NOERROR;
+}
+
+
+//
+// Ordering rule: the superblock may only be written once every block
+// it names has been written.  Deallocation and key counts just mark
+// it dirty, so a crash between writes can leak freed blocks and leave
+// numkeys stale.  A freed block is written out as free before it goes
+// on the list, and allocation writes the free-list link it changes
+// through to disk (see AllocateNode), so a block is never live on
+// disk while the on-disk free list still holds it.  A root change
+// writes the new root and its children through to disk first and then
+// calls this immediately; Checkpoint writes out every other block
+// before the superblock.
+//
+ERROR_T BTreeIndex::WriteSuperblock()
+{
+  ERROR_T rc;
+  lock_guard<mutex> hold(superblock_lock);
+
+  if (!superblock_dirty) { 
+    return ERROR_NOERROR;
+  }
+
+  if ((rc = superblock.Serialize(buffercache,superblock_index))) return rc;
+
+  superblock_dirty=false;
+
+  return ERROR_NOERROR;
 }
     
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  TreeLock whole(treelock, concurrent);
+  nodecache.Detach();
+  initblock=superblock_index;
+  return WriteSuperblock();
+}
+
+
+ERROR_T BTreeIndex::Checkpoint()
+{
+  TreeLock whole(treelock, concurrent);
+  ERROR_T rc;
+
+  if ((rc = WriteSuperblock())) return rc;
+
+  // Every block the superblock names, and every block those name, goes
+  // to disk before the superblock does
+  return buffercache->FlushAll(superblock_index);
 }
  
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
 					   const KEY_T &key,
 					   VALUE_T &value)
 {
-  BTreeNode b;
-  ERROR_T rc;
+  PinnedBlock p(buffercache);
+  SIZE_T node=superblock.info.rootnode;
+  SIZE_T depth=0;
   SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  ERROR_T rc;
 
-  rc= b.Unserialize(buffercache,node);
+  // Down through the interior nodes to the only leaf key can be in.
+  // Those already decoded cost only the compares; others are read,
+  // and decoded for next time
+  while (true) { 
+    if (!nodecache.Find(node,key,node)) { 
+      rc= p.Pin(node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
+      BTreeNodeView b(p.GetFrame());
+      if (b.info.nodetype==BTREE_LEAF_NODE) { 
+	break;
       }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  if(op==BTREE_OP_UPDATE){
-		if((rc = b.SetVal(offset,value))) return rc;
-    rc = b.Serialize(buffercache, node);
-    return rc;
-	  }
-	}
+      if (b.info.numkeys==0) { 
+	// There are no keys at all on this node, so nowhere to go
+	return ERROR_NONEXISTENT;
       }
+      nodecache.Insert(node,b,depth);
+      // The first key that's at least as large tells us which
+      // pointer to recurse on (the last one if there is no such key)
+      rc=b.GetPtr(nodeops->LowerBound(b,key),node);
+      if (rc) { return rc; }
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
+    depth++;
+  }
 
-  return ERROR_INSANE;
+  BTreeNodeView b(p.GetFrame());
+
+  // Search the keys for one that matches
+  offset=nodeops->LowerBound(b,key);
+  if (offset<b.info.numkeys && nodeops->CompareKey(b,offset,key)==0) { 
+    if (op==BTREE_OP_LOOKUP) { 
+      return b.GetVal(offset,value);
+    } else { 
+      // BTREE_OP_UPDATE
+      if((rc = b.SetVal(offset,value))) return rc;
+      p.MarkDirty();
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_NONEXISTENT;
 }
 
-ERROR_T BTreeIndex::InsertInternalRecursive(SIZE_T node, KEY_T key, VALUE_T value, SIZE_T newNode)
+ERROR_T BTreeIndex::InsertInternalRecursive(SIZE_T node, vector<SIZE_T> &path, KEY_T key, VALUE_T value, SIZE_T newNode)
 {
   BTreeNode b;
-  BTreeNode bNew;
   ERROR_T rc;
-
-  //If root node has no keys...
-  if ((rc = b.Unserialize(buffercache, superblock.info.rootnode))) return rc;
-  if (b.info.numkeys == 0)
-  {
-    rc = makeTree(b, key, value);
-    return rc;
-  }
+  vector<SIZE_T> level;
 
   //If this is the first call before any recursion
   if(node == 0)
-    //Find the leaf node that would contain key
-    node = FindLeaf(key);
+  {
+    //If root node has no keys...
+    if ((rc = b.Unserialize(buffercache, superblock.info.rootnode))) return rc;
+    if (b.info.numkeys == 0)
+    {
+      rc = makeTree(b, key, value);
+      return rc;
+    }
+
+    //Find the leaf node that would contain key, and the way down to it
+    node = FindLeaf(key, path);
+  }
 
   //If the leaf node couldn't be found
   if(node == 0)
@@ -284,616 +500,2431 @@ ERROR_T BTreeIndex::InsertInternalRecursive(SIZE_T node, KEY_T key, VALUE_T valu
 
 
   //Add key value pair to node (rhs if interior or root)
-  if ((rc = InsertKeyValue(node, key, value, newNode, true))) return rc;
+  rc = InsertKeyValue(node, key, value, newNode, true);
+
+  //The node has no room for it (a compressed node may have to give up
+  //part of its prefix to take this key), so make room first and insert
+  //into whichever node the key belongs in now.  A split further up may
+  //have moved that node to another parent, so its path is found again.
+  if (rc == ERROR_NOSPACE)
+  {
+    if ((rc = MakeRoom(node, path, key, level))) return rc;
+    if ((rc = DescendTo(key, level, node, path))) return rc;
+    return InsertInternalRecursive(node, path, key, value, newNode);
+  }
+  if (rc) return rc;
 
   //Get node
   if ((rc = b.Unserialize(buffercache, node))) return rc;
 
-  //If leaf node & too full
-  if(b.info.nodetype == BTREE_LEAF_NODE &&
-    ceil((b.info.GetNumSlotsAsLeaf()*(2./3.))) <= b.info.numkeys)
-  {
-    //Create new node
-    SIZE_T newLeafNode;
-    if ((rc = AllocateNode(newLeafNode))) return rc;
-    bNew = b;
-    bNew.info.nodetype = BTREE_LEAF_NODE;
-    bNew.info.numkeys = 0;
-    if ((rc = bNew.Serialize(buffercache,newLeafNode))) return rc;
-    //Split keys (including new key) and values evenly accross both nodes (splitting process specifc to leaf nodes)
-    KEY_T splittingKey = SplitNode(node, newLeafNode);
-    //Find parent of original node
-    SIZE_T parent = FindParent(node);
-    //Add new key (splitting key) and value (pointer to new node) to parent (recursion) (add to right hand side)
-    if ((rc = InsertInternalRecursive(parent, splittingKey, VALUE_T((SIZE_T)0), newLeafNode))) return rc;
-  }
-
-  //If root or interior & too full
-  else if((b.info.nodetype == BTREE_INTERIOR_NODE || b.info.nodetype == BTREE_ROOT_NODE) &&
-    ceil((b.info.GetNumSlotsAsInterior()*(2./3.))) <= b.info.numkeys)
-  {
-    //Create new node
-    SIZE_T newInteriorNode;
-    if ((rc = AllocateNode(newInteriorNode))) return rc;
-    bNew = b;
-    bNew.info.nodetype = BTREE_INTERIOR_NODE;
-    bNew.info.numkeys = 0;
-    if ((rc = bNew.Serialize(buffercache,newInteriorNode))) return rc;
-    //Split keys (including new key) and values evenly accross both nodes (splitting process specifc to internal nodes)
-    KEY_T splittingKey = SplitNode(node, newInteriorNode);
-    //If interior node
-    if(b.info.nodetype == BTREE_INTERIOR_NODE)
-    {
-      //Find parent of original node
-      SIZE_T parent = FindParent(node);
-      //Add new key (splitting key) and value (new node) to parent (recursion) (add to right hand side)
-      if ((rc = InsertInternalRecursive(parent, splittingKey, VALUE_T((SIZE_T)0), newInteriorNode))) return rc;
-    }
-    //If root node
-    else
-    {
-      //Create a new root node
-      SIZE_T newRootNode;
-      if ((rc = AllocateNode(newRootNode))) return rc;
-      bNew = b;
-      bNew.info.nodetype = BTREE_ROOT_NODE;
-      bNew.info.numkeys = 0;
-      if ((rc = bNew.Serialize(buffercache,newRootNode))) return rc;
-      superblock.info.rootnode = newRootNode;
-      superblock.Serialize(buffercache,superblock_index);
-      //Change type of old root node
-      if ((rc = b.Unserialize(buffercache,node))) return rc;
-      b.info.nodetype = BTREE_INTERIOR_NODE;
-      if ((rc = b.Serialize(buffercache,node))) return rc;
-      //Add new key (splitting key) and value (new node) to new root (no recursion) (add to right hand side)
-      if ((rc = InsertKeyValue(newRootNode, splittingKey, VALUE_T((SIZE_T)0), newInteriorNode, true))) return rc;
-      //Add value (old node) to new root (no recursion) (add to left hand side)
-      if ((rc = InsertKeyValue(newRootNode, splittingKey, VALUE_T((SIZE_T)0), node, false))) return rc;
-    }
+  //If too full, split keys and values across it and a new node
+  if (NeedsSplit(b.View()))
+  {
+    if ((rc = MakeRoom(node, path, key, level))) return rc;
   }
 
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::makeTree(BTreeNode referenceNode, KEY_T key, VALUE_T value)
+ERROR_T BTreeIndex::SplitAndPromote(SIZE_T node, vector<SIZE_T> &path, SIZE_T &newNode,
+				    KEY_T &splittingKey, const double fraction)
 {
-  BTreeNode bNew;
+  BTreeNode b;
   ERROR_T rc;
 
-  //Make new leaf node
-  SIZE_T newLeafNode1;
-  if ((rc = AllocateNode(newLeafNode1))) return rc;
-  bNew = referenceNode;
-  bNew.info.nodetype = BTREE_LEAF_NODE;
-  bNew.info.numkeys = 0;
-  if ((rc = bNew.Serialize(buffercache,newLeafNode1))) return rc;
-  //Insert key/value into leaf node
-  if ((rc = InsertKeyValue(newLeafNode1, key, value, (SIZE_T)0, false))) return rc;
-  //Insert leaf node pointer into root (using input key as splitting key) (LHS)
-  if ((rc = InsertKeyValue(superblock.info.rootnode, key, VALUE_T((SIZE_T)0), newLeafNode1, false))) return rc;
+  //Get node
+  if ((rc = b.Unserialize(buffercache, node))) return rc;
 
-  //Make Second new leaf node
-  SIZE_T newLeafNode2;
-  if ((rc = AllocateNode(newLeafNode2))) return rc;
-  bNew = referenceNode;
-  bNew.info.nodetype = BTREE_LEAF_NODE;
-  bNew.info.numkeys = 0;
-  if ((rc = bNew.Serialize(buffercache,newLeafNode2))) return rc;
-  //Insert leaf node pointer into root (using input key as splitting key) (RHS)
-  if ((rc = InsertKeyValue(superblock.info.rootnode, key, VALUE_T((SIZE_T)0), newLeafNode2, true))) return rc;
+  //Create new node of the same kind and format next to it
+  if ((rc = AllocateNode(newNode, node))) return rc;
+  if ((rc = InitNode(newNode,
+                     b.info.nodetype == BTREE_LEAF_NODE ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+                     b.info.format))) return rc;
 
-  return ERROR_NOERROR;
+  //Split keys and values across both nodes
+  splittingKey = SplitNode(node, newNode, fraction);
+
+  //If leaf or interior node
+  if(b.info.nodetype != BTREE_ROOT_NODE)
+  {
+    //The parent is the last node on the way down to this one
+    if(path.empty()) return ERROR_INSANE;
+    SIZE_T parent = path.back();
+    path.pop_back();
+    //Add new key (splitting key) and value (new node) to parent (recursion) (add to right hand side)
+    return InsertInternalRecursive(parent, path, splittingKey, VALUE_T((SIZE_T)0), newNode);
+  }
+
+  //If root node, create a new root node above
+  return GrowRoot(node, splittingKey, newNode);
 }
 
-SIZE_T BTreeIndex::FindLeaf(KEY_T key)
+ERROR_T BTreeIndex::GrowRoot(SIZE_T node, const KEY_T &splittingKey, SIZE_T newNode)
 {
   BTreeNode b;
   ERROR_T rc;
-  SIZE_T currentNode;
-  KEY_T testkey;
-
-  //Set current node as the root of the tree
-  currentNode = superblock.info.rootnode;
-  if((rc= b.Unserialize(buffercache, currentNode))) return 0;
-
-  while(b.info.nodetype != BTREE_LEAF_NODE)
+  SIZE_T newRootNode;
+
+  if ((rc = AllocateNode(newRootNode, node))) return rc;
+  if ((rc = InitNode(newRootNode, BTREE_ROOT_NODE, GetNodeFormat(BTREE_ROOT_NODE)))) return rc;
+  //Old root becomes an interior node below
+  if ((rc = b.Unserialize(buffercache,node))) return rc;
+  b.info.nodetype = BTREE_INTERIOR_NODE;
+  if ((rc = b.Serialize(buffercache,node))) return rc;
+  //Add new key (splitting key) and value (new node) to new root (no recursion) (add to right hand side)
+  if ((rc = InsertKeyValue(newRootNode, splittingKey, VALUE_T((SIZE_T)0), newNode, true))) return rc;
+  //Add value (old node) to new root (no recursion) (add to left hand side)
+  if ((rc = InsertKeyValue(newRootNode, splittingKey, VALUE_T((SIZE_T)0), node, false))) return rc;
+  //Publish the new root only once it and both its children are on
+  //disk (and, to other threads, under the superblock's latch; see
+  //InsertLatched)
+  if ((rc = buffercache->FlushBlock(node)) ||
+      (rc = buffercache->FlushBlock(newNode)) ||
+      (rc = buffercache->FlushBlock(newRootNode))) return rc;
   {
-
-    // Scan through key/ptr pairs
-    for (int offset=0; offset<b.info.numkeys; offset++)
-    { 
-      //Store key at offset in testkey
-      if((rc = b.GetKey(offset, testkey))) return 0;
-      //If testkey ==key or is less than key, we've found the correct pointer
-      if (key<testkey || key==testkey)
-      {
-        //Get the correct pointer (to the node that's one level down)
-        if((rc=b.GetPtr(offset,currentNode))) return 0;
-        //Exit the for loop
-        break;
-      }
-    }
-    //Edge case: input key is larger than any keys in current node
-    b.GetKey(b.info.numkeys-1,testkey);
-    if(testkey < key)
-    {
-      //Get the correct pointer (to the node that's one level down)
-      if((rc=b.GetPtr(b.info.numkeys,currentNode))) return 0;
-    }
-
-    //Get the node
-    if((rc= b.Unserialize(buffercache, currentNode))) return 0;
+    lock_guard<mutex> hold(superblock_lock);
+    //Optimistic descents read it without a latch
+    __atomic_store_n(&superblock.info.rootnode, newRootNode, __ATOMIC_RELAXED);
+    superblock_dirty = true;
   }
+  return WriteSuperblock();
+}
 
-  //Return pointer to leaf node that would contain key
-  return currentNode;
+bool BTreeIndex::NeedsSplit(const BTreeNodeView &b) const
+{
+  //The other policies wait until an entry does not fit, and top-down
+  //inserts until the next insert comes down to node
+  return !topdown && splitpolicy == BTREE_SPLIT_EAGER && b.GetFill() >= 2./3.;
 }
 
-ERROR_T BTreeIndex::InsertKeyValue(SIZE_T node, KEY_T key, VALUE_T value, SIZE_T newNode, bool rhs)
+bool BTreeIndex::IsFull(const BTreeNodeView &b) const
 {
-  BTreeNode b;
+  if (splitpolicy == BTREE_SPLIT_EAGER && b.GetFill() >= 2./3.) return true;
+  return !b.HasRoomForEntry();
+}
+
+ERROR_T BTreeIndex::InsertTopDown(const KEY_T &key, const VALUE_T &value)
+{
+  vector<SIZE_T> path;
+  SIZE_T node = superblock.info.rootnode;
   ERROR_T rc;
-  KEY_T testkey = KEY_T((SIZE_T)0);
 
-  //Get node from pointer
-  if ((rc = b.Unserialize(buffercache, node))) return rc;
-   
-  //Find place in key list
-  SIZE_T offset = 0;
-  for (; offset<b.info.numkeys; offset++)
-  { 
-    rc=b.GetKey(offset,testkey);
-    if (rc)
-      return rc;
-    if (testkey==key || key<testkey)
-      break;
+  //The first key makes the first two leaves
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(node))) return rc;
+    if (BTreeNodeView(p.GetFrame()).info.numkeys == 0)
+    {
+      p.Unpin();
+      return InsertInternalRecursive(0, path, key, value, 0);
+    }
   }
 
-  switch(b.info.nodetype)
+  while (true)
   {
-    //If leaf node
-    case BTREE_LEAF_NODE:
-
-      if (testkey==key)
-      {
-        return ERROR_CONFLICT;
-      }
-      //If the input key isn't less than any key in the node...
-      if (offset == b.info.numkeys)
-      {
-        //Increment the number of keys
-        b.info.numkeys+=1;
-        superblock.info.numkeys++;
+    int nodetype;
+    SIZE_T format;
+    bool full;
+    SIZE_T child = 0;
 
-        //Add to the end of the list
-        if ((rc = b.SetKey(offset,key))) return rc;
-        if ((rc = b.SetVal(offset,value))) return rc;
-      }
-
-      else
+    {
+      PinnedBlock p(buffercache);
+      if ((rc = p.Pin(node))) return rc;
+      BTreeNodeView b(p.GetFrame());
+      nodetype = b.info.nodetype;
+      format = b.info.format;
+      full = IsFull(b);
+      if (!full && nodetype != BTREE_LEAF_NODE)
       {
-        //Increment the number of keys
-        b.info.numkeys+=1;
-        superblock.info.numkeys++;
-
-        //Use input key-value as initial prev values
-        KEY_T keyPrev = key;
-        VALUE_T valuePrev = value;
-        //Use key-value of testKey (1st key greater than input key) as curr values
-        KEY_T keyCurr = testkey;
-        VALUE_T valueCurr;
-        rc = b.GetVal(offset,valueCurr);
-        if (rc)
-          return rc;
-
-        //Insert input key-value pair and move all other pairs over
-        for (SIZE_T i=offset; i<b.info.numkeys; i++)
-        {
-          //Store previous keys-value at current key-value location
-          rc = b.SetKey(i,keyPrev);
-          if (rc)
-            return rc;
-          rc = b.SetVal(i,valuePrev);
-          if (rc)
-            return rc;
-
-          //Set current key-value to previous key-value
-          keyPrev=keyCurr;
-          valuePrev=valueCurr;
-
-          //If we're not looking at the current end of the list...
-          if(i < b.info.numkeys - 2)
-          {
-            //Get new current key-value at the next location
-            rc=b.GetKey(i+1,keyCurr);
-            if (rc)
-              return rc;
-            rc=b.GetVal(i+1,valueCurr);
-            if (rc)
-              return rc;
-          }
-        }
+        if ((rc = b.GetPtr(nodeops->LowerBound(b,key),child))) return rc;
       }
+    }
 
-      //Write changes back to the disk
-      if ((rc=b.Serialize(buffercache,node))) return rc;
-      return ERROR_NOERROR;
-
-    //If root or interior node
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-
-      if (testkey == key)
+    if (!full)
+    {
+      //A leaf with room takes the key here
+      if (nodetype == BTREE_LEAF_NODE)
       {
-        //If passed in value == 1, add to the rhs
-        if(rhs)
-        {
-          if ((rc = b.SetPtr(offset+1,newNode))) return rc;
-        }
-        //If passed in value == 0, add to the lfs
-        else
-        {
-          if ((rc = b.SetPtr(offset,newNode))) return rc;
-        }
+        return InsertInternalRecursive(node, path, key, value, 0);
       }
+      path.push_back(node);
+      node = child;
+      continue;
+    }
 
-      else if (offset == b.info.numkeys)
-      {
-        //Increment the number of keys
-        b.info.numkeys+=1;
-        superblock.info.numkeys++;
+    SIZE_T sibling;
+    KEY_T splittingKey;
+    bool edge;
 
-        //Add to the end of the list
-        if ((rc = b.SetKey(offset,key))) return rc;
-        //If passed in value == 1, add to the rhs
-        if(rhs)
-        {
-          if ((rc = b.SetPtr(offset+1,newNode))) return rc;
-        }
-        //If passed in value == 0, add to the lfs
-        else
-        {
-          if ((rc = b.SetPtr(offset,newNode))) return rc;
-        }
-      }
+    if ((rc = AtRightEdge(node, path, key, edge))) return rc;
+    double fraction = edge ? BTREE_APPEND_SPLIT_FILL : 0.5;
 
-      //Insert new key in front of testKey and a new value
-      //to the right of the new key (always to the right)
-      else
+    if (path.empty())
+    {
+      //The root grows a new root above it
+      if ((rc = SplitAndPromote(node, path, sibling, splittingKey, fraction))) return rc;
+      path.push_back(superblock.info.rootnode);
+    }
+    else
+    {
+      //Split off a new sibling and hand the splitting key straight to
+      //the parent, which was not full on the way through it
+      if ((rc = AllocateNode(sibling, node))) return rc;
+      if ((rc = InitNode(sibling,
+                         nodetype == BTREE_LEAF_NODE ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+                         format))) return rc;
+      splittingKey = SplitNode(node, sibling, fraction);
+      rc = InsertKeyValue(path.back(), splittingKey, VALUE_T((SIZE_T)0), sibling, true);
+
+      //A prefix-compressed parent may not have room after all, so it
+      //splits bottom-up, and where the key goes is found from the root
+      if (rc == ERROR_NOSPACE)
       {
-        //Increment the number of keys
-        b.info.numkeys+=1;
-        superblock.info.numkeys++;
-
-        //Use input key-vlue as initial prev values
-        KEY_T keyPrev = key;
-        SIZE_T ptrPrev = newNode;
-        //Use key-value of testKey (1st key greater than input key) as curr values
-        KEY_T keyCurr = testkey;
-        SIZE_T ptrCurr;
-        rc = b.GetPtr(offset+1, ptrCurr); //Use value to the right of testkey
-        if (rc)
-          return rc;
-
-        //Insert input key-value pair and move all other pairs over
-        for (SIZE_T i=offset; i<b.info.numkeys; i++)
-        {
-          //Store previous keys-value at current key-value location
-          rc = b.SetKey(i,keyPrev);
-          if (rc)
-            return rc;
-          rc = b.SetPtr(i+1,ptrPrev);
-          if (rc)
-            return rc;
-
-          //Set current key-value to previous key-value
-          keyPrev = keyCurr;
-          ptrPrev = ptrCurr;
-
-          //If we're not looking at the current end of the list...
-          if(i < b.info.numkeys - 2)
-          {
-            //Get new current key-value at the next location
-            rc=b.GetKey(i+1,keyCurr);
-            if (rc)
-              return rc;
-            rc=b.GetPtr(i+2,ptrCurr);
-            if (rc)
-              return rc;
-          }
-        }
+        SIZE_T parent = path.back();
+        vector<SIZE_T> level;
+        path.pop_back();
+        if ((rc = InsertInternalRecursive(parent, path, splittingKey, VALUE_T((SIZE_T)0), sibling))) return rc;
+        level.push_back(node);
+        level.push_back(sibling);
+        if ((rc = DescendTo(key, level, node, path))) return rc;
+        continue;
       }
+      if (rc) return rc;
+    }
 
-      //Write changes back to the disk
-      if ((rc=b.Serialize(buffercache,node))) return rc;
-      return ERROR_NOERROR;
-
-    //If node of these types, error
-    default:
-      return ERROR_INSANE;
+    //Go on down whichever half the key belongs in
+    if (CompareKeys(key, splittingKey) > 0) node = sibling;
   }
 }
 
-KEY_T BTreeIndex::SplitNode(SIZE_T node, SIZE_T newNode)
+ERROR_T BTreeIndex::DescendLatched(const KEY_T &key, const bool exclusive, LatchSet &held,
+				   PinnedBlock &p, SIZE_T &leaf)
 {
-  BTreeNode b;
-  BTreeNode bNew;
+  SIZE_T node, child;
+  SIZE_T depth = 0;
   ERROR_T rc;
-  KEY_T tempKey;
-  SIZE_T tempPtr;
-  VALUE_T tempVal;
-
-  //Get the input node
-  if((rc = b.Unserialize(buffercache, node))) return KEY_T((SIZE_T)0);
-  //Get the input new node
-  if((rc = bNew.Unserialize(buffercache, newNode))) return KEY_T((SIZE_T)0);
 
+  //The root pointer is read under the superblock's latch, and each
+  //node is latched before the one above it is let go
+  held.LockShared(superblock_index);
+  node = superblock.info.rootnode;
+  held.LockShared(node);
 
-  //Get the total number of keys
-  SIZE_T totalKeyNum = b.info.numkeys;
-  //Get index of halfway point
-  SIZE_T halfOffset = totalKeyNum/2;
-  //Get splitting key (last key to be left in original node)
-  KEY_T splittingKey;
-  if((rc=b.GetKey(halfOffset-1,splittingKey))) return KEY_T((SIZE_T)0);
+  while (true)
+  {
+    if (!nodecache.Find(node, key, child))
+    {
+      if ((rc = p.Pin(node))) return rc;
+      BTreeNodeView b(p.GetFrame());
+      if (b.info.nodetype == BTREE_LEAF_NODE) break;
 
-  //Initialize offset for new node
-  SIZE_T iNew = 0;
+      //An empty root has no leaves at all
+      if (b.info.numkeys == 0) return ERROR_NONEXISTENT;
 
-  if(b.info.nodetype == BTREE_LEAF_NODE)
+      nodecache.Insert(node, b, depth);
+      if ((rc = b.GetPtr(nodeops->LowerBound(b,key), child))) return rc;
+    }
+    held.LockShared(child);
+    held.ReleaseAllBut(node);
+    node = child;
+    depth++;
+  }
+
+  //Only a split changes which leaf holds key, and that needs the
+  //parent exclusively, so with the parent still held the shared latch
+  //can be traded for an exclusive one
+  if (exclusive)
   {
-    //Move key-value pairs from one node to the other
-    for (SIZE_T i=halfOffset; i<totalKeyNum; i++)
-    {
-      //Get key-value pair from node
-      if((rc=b.GetKey(i,tempKey))) return KEY_T((SIZE_T)0);
-      if((rc=b.GetVal(i,tempVal))) return KEY_T((SIZE_T)0);
+    held.Release(node);
+    held.LockExclusive(node);
+  }
+  held.ReleaseAllBut(node);
+  leaf = node;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::LookupOrUpdateLatched(const BTreeOp op, const KEY_T &key, VALUE_T &value)
+{
+  LatchSet held(latches);
+  PinnedBlock p(buffercache);
+  SIZE_T leaf;
+  ERROR_T rc;
+
+  if (superblock.info.format & BTREE_OPT_BLINK)
+  {
+    rc = DescendBlink(key, op == BTREE_OP_UPDATE, held, p, leaf);
+  }
+  else if (optimistic)
+  {
+    rc = DescendOptimistic(key, op == BTREE_OP_UPDATE, held, p, leaf);
+  }
+  else
+  {
+    rc = DescendLatched(key, op == BTREE_OP_UPDATE, held, p, leaf);
+  }
+  if (rc) return rc;
+
+  BTreeNodeView b(p.GetFrame());
+  SIZE_T offset = nodeops->LowerBound(b,key);
+  if (offset >= b.info.numkeys || nodeops->CompareKey(b,offset,key) != 0)
+  {
+    return ERROR_NONEXISTENT;
+  }
+  if (op == BTREE_OP_LOOKUP) return b.GetVal(offset,value);
+
+  if ((rc = b.SetVal(offset,value))) return rc;
+  p.MarkDirty();
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::InsertLatched(const KEY_T &key, const VALUE_T &value, bool &exclusive)
+{
+  ERROR_T rc;
+
+  exclusive = false;
+
+  //Most inserts find a leaf with room, and need nothing but that leaf
+  //exclusively
+  {
+    LatchSet held(latches);
+    PinnedBlock p(buffercache);
+    SIZE_T leaf;
+    bool full;
 
-      //Insert key-value pair into new node
-      bNew.info.numkeys++;
-      if((rc=bNew.SetKey(iNew,tempKey))) return KEY_T((SIZE_T)0);
-      if((rc=bNew.SetVal(iNew,tempVal))) return KEY_T((SIZE_T)0);
+    if (optimistic)
+    {
+      rc = DescendOptimistic(key, true, held, p, leaf);
+    }
+    else
+    {
+      rc = DescendLatched(key, true, held, p, leaf);
+    }
+    //The first key makes the first two leaves, with the tree to itself
+    if (rc == ERROR_NONEXISTENT)
+    {
+      exclusive = true;
+      return ERROR_NOERROR;
+    }
+    if (rc) return rc;
 
-      //Increment the new node offset
-      iNew++;
+    full = IsFull(BTreeNodeView(p.GetFrame()));
+    p.Unpin();
+    if (!full)
+    {
+      rc = InsertKeyValue(leaf, key, value, 0, true);
+      if (rc != ERROR_NOSPACE) return rc;
     }
-    b.info.numkeys = halfOffset;
   }
 
-  else if(b.info.nodetype == BTREE_INTERIOR_NODE || b.info.nodetype == BTREE_ROOT_NODE)
+  if (optimistic) return InsertOptimistic(key, value, exclusive);
+
+  //Otherwise start again with exclusive latches, splitting each full
+  //node on the way down while its parent, which has room for the
+  //splitting key, is still held.  The parent is let go once the node
+  //below it is not full.
+  LatchSet held(latches);
+  SIZE_T node, parent = 0;
+  bool edge = true;   // node is the last on its level
+
+  held.LockExclusive(superblock_index);
+  node = superblock.info.rootnode;
+  held.LockExclusive(node);
+
+  while (true)
   {
-    //Move key-value pairs from one node to the other
-    for (SIZE_T i=halfOffset; i<totalKeyNum; i++)
+    int nodetype;
+    SIZE_T format, numkeys, offset, right = 0;
+    SIZE_T child = 0;
+    bool full;
+
     {
-      //Get key-value pair from node
-      if((rc=b.GetKey(i,tempKey))) return KEY_T((SIZE_T)0);
-      if((rc=b.GetPtr(i,tempPtr))) return KEY_T((SIZE_T)0);
+      PinnedBlock p(buffercache);
+      if ((rc = p.Pin(node))) return rc;
+      BTreeNodeView b(p.GetFrame());
+      nodetype = b.info.nodetype;
+      format = b.info.format;
+      numkeys = b.info.numkeys;
+      full = IsFull(b);
+      offset = nodeops->LowerBound(b,key);
+      if (nodetype == BTREE_LEAF_NODE)
+      {
+        right = b.GetRightSibling();
+      }
+      else
+      {
+        if ((rc = b.GetPtr(offset,child))) return rc;
+      }
+    }
 
-      //Insert key-value pair into new node
-      bNew.info.numkeys++;
-      if((rc=bNew.SetKey(iNew,tempKey))) return KEY_T((SIZE_T)0);
-      if((rc=bNew.SetPtr(iNew,tempPtr))) return KEY_T((SIZE_T)0);
+    if (parent == 0 && numkeys == 0)
+    {
+      exclusive = true;
+      return ERROR_NOERROR;
+    }
 
-      //Increment the new node offset
-      iNew++;
+    if (!full)
+    {
+      held.ReleaseAllBut(node);
+      if (nodetype == BTREE_LEAF_NODE)
+      {
+        rc = InsertKeyValue(node, key, value, 0, true);
+        //A variable-length leaf without room for this pair after all
+        if (rc == ERROR_NOSPACE)
+        {
+          exclusive = true;
+          return ERROR_NOERROR;
+        }
+        return rc;
+      }
+      held.LockExclusive(child);
+      parent = node;
+      node = child;
+      edge = edge && offset == numkeys;
+      continue;
     }
 
-    //If we are splitting an interior or root node, there will be one more pointer at the end
-    //Get value from node
-    if((rc=b.GetPtr(totalKeyNum,tempPtr))) return KEY_T((SIZE_T)0);
-    //Insert value into new node
-    if((rc=bNew.SetPtr(iNew,tempPtr))) return KEY_T((SIZE_T)0);
+    //Append splitting, with the right edge known from the way down
+    double fraction = appendsplit && edge && offset == numkeys ? BTREE_APPEND_SPLIT_FILL : 0.5;
+    SIZE_T sibling;
+    KEY_T splittingKey;
 
-    b.info.numkeys = halfOffset;
+    if (parent == 0)
+    {
+      //The new root is published while the superblock's latch is
+      //held exclusively, and the descent starts again from it
+      vector<SIZE_T> path;
+      if ((rc = SplitAndPromote(node, path, sibling, splittingKey, fraction))) return rc;
+      held.ReleaseAll();
+      held.LockExclusive(superblock_index);
+      node = superblock.info.rootnode;
+      held.LockExclusive(node);
+      edge = true;
+      continue;
+    }
+
+    //Nobody else can reach the new sibling until the parent is let go,
+    //but the leaf to the right has its left link changed
+    if ((rc = AllocateNode(sibling, node))) return rc;
+    held.LockExclusive(sibling);
+    if ((rc = InitNode(sibling,
+                       nodetype == BTREE_LEAF_NODE ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+                       format))) return rc;
+    if (right != 0) held.LockExclusive(right);
+    splittingKey = SplitNode(node, sibling, fraction);
+    if (right != 0) held.Release(right);
+    if ((rc = InsertKeyValue(parent, splittingKey, VALUE_T((SIZE_T)0), sibling, true))) return rc;
+
+    //Go on down whichever half the key belongs in, still holding the
+    //parent until that half is found not to be full
+    if (CompareKeys(key, splittingKey) > 0)
+    {
+      held.Release(node);
+      node = sibling;
+    }
+    else
+    {
+      held.Release(sibling);
+      edge = false;
+    }
   }
+}
+
+ERROR_T BTreeIndex::DescendOptimistic(const KEY_T &key, const bool exclusive, LatchSet &held,
+				      PinnedBlock &p, SIZE_T &leaf)
+{
+  NodeLatch &top = latches.Get(superblock_index);
+  Block copy;
+  ERROR_T rc;
 
-  //Write the input node to disk
-  if((rc = b.Serialize(buffercache, node))) return KEY_T((SIZE_T)0);
-  //Write the input new node to disk
-  if((rc = bNew.Serialize(buffercache, newNode))) return KEY_T((SIZE_T)0);
+  //Any node seen to change on the way down sends the search back to
+  //the root
+  for (;; p.Unpin(), held.ReleaseAll(), sched_yield())
+  {
+    SIZE_T node, child;
+    SIZE_T depth = 0;
+    VERSION_T vs, vn, vc;
 
-  if((rc = b.Unserialize(buffercache, node))) return KEY_T((SIZE_T)0);
+    //The root pointer is read between two looks at the superblock's
+    //latch, which is held exclusively to change it
+    if (!top.ReadVersion(vs)) continue;
+    node = __atomic_load_n(&superblock.info.rootnode, __ATOMIC_RELAXED);
+    if (!latches.Get(node).ReadVersion(vn) || !top.Validate(vs)) continue;
 
-  return splittingKey;
+    while (true)
+    {
+      //A decoded copy is searched without latching the node; the
+      //child is right if the copy was made at version vn and the node
+      //is still at vn afterwards.  The child's version is read first,
+      //so that a split of the child, which needs the node, shows up
+      //when the child is reached.  A copy made at another version is
+      //dropped, and the node read again.
+      VERSION_T vd;
+      if (nodecache.Find(node, key, child, 0, 0, 0, &vd))
+      {
+        if (vd == vn)
+        {
+          if (!latches.Get(child).ReadVersion(vc) || !latches.Get(node).Validate(vn)) break;
+          node = child;
+          vn = vc;
+          depth++;
+          continue;
+        }
+        nodecache.Forget(node);
+      }
+
+      //Otherwise the node is read from its frame without a latch.  A
+      //leaf is latched after all: it changes the most, and the caller
+      //goes on to use it in place
+      if ((rc = p.Pin(node))) return rc;
+      if (BTreeNodeView(p.GetFrame()).info.nodetype == BTREE_LEAF_NODE)
+      {
+        p.Unpin();
+        if (exclusive) held.LockExclusive(node);
+        else held.LockShared(node);
+        if (latches.Get(node).GetVersion() != vn)
+        {
+          held.ReleaseAllUnchanged();
+          break;
+        }
+        if ((rc = p.Pin(node))) return rc;
+        leaf = node;
+        return ERROR_NOERROR;
+      }
+
+      //An interior node is copied out and used only if it is still at
+      //version vn afterwards, so a torn read of one is never searched
+      if (copy.length == 0 && (rc = copy.Resize(p.GetFrame().length, false))) return rc;
+      memcpy(copy.data, p.GetFrame().data, copy.length);
+      p.Unpin();
+      if (!latches.Get(node).Validate(vn)) break;
+      BTreeNodeView b(copy);
+
+      //An empty root has no leaves at all
+      if (b.info.numkeys == 0) return ERROR_NONEXISTENT;
+
+      if ((rc = b.GetPtr(nodeops->LowerBound(b,key), child))) return rc;
+      //A writer that changes the node drops its decoded copy, but may
+      //do so before this one goes in, so this one is dropped in turn
+      //unless the node is still at vn after it is kept
+      nodecache.Insert(node, b, depth, vn);
+      bool ok = latches.Get(child).ReadVersion(vc);
+      if (!latches.Get(node).Validate(vn))
+      {
+        nodecache.Forget(node);
+        break;
+      }
+      if (!ok) break;
+      node = child;
+      vn = vc;
+      depth++;
+    }
+  }
 }
 
-SIZE_T BTreeIndex::FindParent(SIZE_T node)
+ERROR_T BTreeIndex::InsertOptimistic(const KEY_T &key, const VALUE_T &value, bool &exclusive)
 {
-  BTreeNode b;
+  NodeLatch &top = latches.Get(superblock_index);
+  Block copy;
   ERROR_T rc;
-  SIZE_T currentNode;
-  SIZE_T prevNode;
-  KEY_T testKey;
-  KEY_T prevTestKey;
-  KEY_T largest;
-  KEY_T smallest;
 
-  //Get the input node
-  if((rc = b.Unserialize(buffercache, node))) return 0;
+  //Each node on the way down is copied out without a latch and used
+  //only if it is still at the version read before the copy, noting
+  //that and the version of the child it leads to.  The first full node
+  //found is split with only it, its parent and the new sibling (and a
+  //leaf's right neighbour) latched exclusively, once the parent and
+  //the node are seen to be as they were read; the parent has room,
+  //since it was not full.  Then the descent starts again, until it
+  //finds the leaf for key with room.  A node latched exclusively only
+  //to find it has changed is let go of unchanged, so that writers
+  //that lose a race do not make each other start again.
+  for (;; sched_yield())
+  {
+    LatchSet held(latches);
+    SIZE_T node, parent = superblock_index;
+    VERSION_T vp, vn;
+    bool edge = true;   // node is the last on its level
 
-  //Get the largest and smallest keys in the input node
-  b.GetKey(b.info.numkeys-1, largest);
-  b.GetKey(0, smallest);
+    if (!top.ReadVersion(vp)) continue;
+    node = __atomic_load_n(&superblock.info.rootnode, __ATOMIC_RELAXED);
+    if (!latches.Get(node).ReadVersion(vn) || !top.Validate(vp)) continue;
 
-  //Start at the root of the tree
-  currentNode = superblock.info.rootnode;
-  if((rc = b.Unserialize(buffercache, currentNode))) return 0;
+    while (true)
+    {
+      int nodetype;
+      SIZE_T format, numkeys, offset, right = 0;
+      SIZE_T child = 0;
+      VERSION_T vc = 0;
+      bool full;
 
-  while(b.info.nodetype != BTREE_LEAF_NODE)
-  {
+      {
+        PinnedBlock p(buffercache);
+        if ((rc = p.Pin(node))) return rc;
+        if (copy.length == 0 && (rc = copy.Resize(p.GetFrame().length, false))) return rc;
+        memcpy(copy.data, p.GetFrame().data, copy.length);
+      }
+      if (!latches.Get(node).Validate(vn)) break;
+      {
+        BTreeNodeView b(copy);
+        nodetype = b.info.nodetype;
+        format = b.info.format;
+        numkeys = b.info.numkeys;
+        full = IsFull(b);
+        offset = nodeops->LowerBound(b,key);
+        if (nodetype == BTREE_LEAF_NODE)
+        {
+          right = b.GetRightSibling();
+        }
+        else
+        {
+          if ((rc = b.GetPtr(offset,child))) return rc;
+        }
+      }
+      if (nodetype != BTREE_LEAF_NODE && !latches.Get(child).ReadVersion(vc)) break;
+      if (!latches.Get(node).Validate(vn)) break;
+
+      if (parent == superblock_index && numkeys == 0)
+      {
+        exclusive = true;
+        return ERROR_NOERROR;
+      }
+
+      if (!full && nodetype == BTREE_LEAF_NODE)
+      {
+        held.LockExclusive(node);
+        if (latches.Get(node).GetVersion() != vn)
+        {
+          held.ReleaseAllUnchanged();
+          break;
+        }
+        rc = InsertKeyValue(node, key, value, 0, true);
+        //A variable-length leaf without room for this pair after all
+        if (rc == ERROR_NOSPACE)
+        {
+          exclusive = true;
+          return ERROR_NOERROR;
+        }
+        return rc;
+      }
+      if (!full)
+      {
+        edge = edge && offset == numkeys;
+        parent = node;
+        vp = vn;
+        node = child;
+        vn = vc;
+        continue;
+      }
+
+      //Parent before child, as everywhere else
+      held.LockExclusive(parent);
+      if (latches.Get(parent).GetVersion() != vp)
+      {
+        held.ReleaseAllUnchanged();
+        break;
+      }
+      held.LockExclusive(node);
+      if (latches.Get(node).GetVersion() != vn)
+      {
+        held.ReleaseAllUnchanged();
+        break;
+      }
+
+      double fraction = appendsplit && edge && offset == numkeys ? BTREE_APPEND_SPLIT_FILL : 0.5;
+      SIZE_T sibling;
+      KEY_T splittingKey;
 
-    //Initialize prevTestKey
-    prevTestKey = KEY_T((SIZE_T)0);
+      if (parent == superblock_index)
+      {
+        vector<SIZE_T> path;
+        if ((rc = SplitAndPromote(node, path, sibling, splittingKey, fraction))) return rc;
+        break;
+      }
+      if ((rc = AllocateNode(sibling, node))) return rc;
+      held.LockExclusive(sibling);
+      if ((rc = InitNode(sibling,
+                         nodetype == BTREE_LEAF_NODE ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+                         format))) return rc;
+      if (right != 0) held.LockExclusive(right);
+      splittingKey = SplitNode(node, sibling, fraction);
+      if (right != 0) held.Release(right);
+      if ((rc = InsertKeyValue(parent, splittingKey, VALUE_T((SIZE_T)0), sibling, true))) return rc;
+      break;
+    }
+  }
+}
+
+ERROR_T BTreeIndex::DescendBlink(const KEY_T &key, const bool exclusive, LatchSet &held,
+				 PinnedBlock &p, SIZE_T &leaf, vector<SIZE_T> *path)
+{
+  SIZE_T node, child;
+  SIZE_T depth = 0;
+  bool across;
+  ERROR_T rc;
 
-    // Scan through key/ptr pairs
-    for (int offset=0; offset<b.info.numkeys; offset++)
-    { 
-      //Store key at offset in testkey
-      if((rc = b.GetKey(offset, testKey))) return 0;
-      //If key range of input node is between this key and the previous key
-      if ((largest < testKey || largest == testKey) && prevTestKey < smallest)
+  //While the tree lock is shared nodes split but never go away: an
+  //old root still leads down after a new one goes above it, and a
+  //node that splits before it is reached leads on to its right half.
+  //So one latch at a time is enough.
+  held.LockShared(superblock_index);
+  node = superblock.info.rootnode;
+  held.Release(superblock_index);
+
+  while (true)
+  {
+    //A decoded copy that is out of date still leads somewhere on the
+    //way to key, since nodes only ever move keys to the right
+    if (!nodecache.Find(node, key, child, 0, 0, &across))
+    {
+      held.LockShared(node);
+      if ((rc = p.Pin(node))) return rc;
+      BTreeNodeView b(p.GetFrame());
+      across = b.IsPastHighKey(key);
+      if (across)
+      {
+        child = b.GetRightSibling();
+      }
+      else if (b.info.nodetype == BTREE_LEAF_NODE)
       {
-        //Store the pointer to this node
-        prevNode = currentNode;
-        //Get the correct pointer (to the node that's one level down)
-        if((rc=b.GetPtr(offset,currentNode))) return 0;
-        //If the next node is the input node...
-        if(currentNode == node)
-          //Return a pointer to the prevous node
-          return prevNode;
-        //Get the node at that pointer
-        if((rc = b.Unserialize(buffercache, currentNode))) return 0;
-        //Exit the for loop
+        if (!exclusive)
+        {
+          leaf = node;
+          return ERROR_NOERROR;
+        }
         break;
       }
       else
       {
-        prevTestKey = testKey;
+        //An empty root has no leaves at all
+        if (b.info.numkeys == 0) return ERROR_NONEXISTENT;
+
+        nodecache.Insert(node, b, depth);
+        if ((rc = b.GetPtr(nodeops->LowerBound(b,key), child))) return rc;
       }
+      p.Unpin();
+      held.Release(node);
     }
-    //Edge case: input minimum is larger than any keys in current node
-    b.GetKey(b.info.numkeys-1, testKey);
-    if(testKey < smallest)
+    if (!across)
     {
-      //Store the pointer to this node
-      prevNode = currentNode;
-      //Get the correct pointer (to the node that's one level down)
-      if((rc=b.GetPtr(b.info.numkeys,currentNode))) return 0;
-      //If the next node is the input node...
-      if(currentNode == node)
-        //Return a pointer to the prevous node
-        return prevNode;
-      //Get the node at that pointer
-      if((rc = b.Unserialize(buffercache, currentNode))) return 0;
+      if (path) path->push_back(node);
+      depth++;
     }
-
-    //Get the node form the disk 
-    if((rc = b.Unserialize(buffercache, currentNode))) return 0;
+    node = child;
   }
 
-  //Return 0 to indicate no parent was found
-  return 0;
+  //The leaf may split while its latch is traded for an exclusive one,
+  //and then key may have moved right
+  p.Unpin();
+  held.Release(node);
+  held.LockExclusive(node);
+  while (true)
+  {
+    if ((rc = p.Pin(node))) return rc;
+    BTreeNodeView b(p.GetFrame());
+    if (!b.IsPastHighKey(key)) break;
+    child = b.GetRightSibling();
+    p.Unpin();
+    held.LockExclusive(child);
+    held.Release(node);
+    node = child;
+  }
+  leaf = node;
+  return ERROR_NOERROR;
 }
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::InsertBlink(const KEY_T &key, const VALUE_T &value, bool &exclusive)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
+  LatchSet held(latches);
+  vector<SIZE_T> path;
+  SIZE_T node, ptr = 0;
+  SIZE_T height = 0;   // levels above the leaves
+  KEY_T k = key;
   ERROR_T rc;
-  unsigned i;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  exclusive = false;
+
+  {
+    PinnedBlock p(buffercache);
+    rc = DescendBlink(key, true, held, p, node, &path);
+    //The first key makes the first two leaves, with the tree to itself
+    if (rc == ERROR_NONEXISTENT)
+    {
+      exclusive = true;
+      return ERROR_NOERROR;
+    }
+    if (rc) return rc;
   }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
-      }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
-      }
+  //node is latched exclusively, and k goes into it, or further right:
+  //the key at the leaf, then the splitting key and the new sibling of
+  //each node split, a level up
+  while (true)
+  {
+    int nodetype;
+    SIZE_T format, numkeys, offset, right;
+    bool full, found, past;
+
+    {
+      PinnedBlock p(buffercache);
+      if ((rc = p.Pin(node))) return rc;
+      BTreeNodeView b(p.GetFrame());
+      nodetype = b.info.nodetype;
+      format = b.info.format;
+      numkeys = b.info.numkeys;
+      full = IsFull(b);
+      offset = nodeops->LowerBound(b,k);
+      found = offset < numkeys && nodeops->CompareKey(b,offset,k) == 0;
+      right = b.GetRightSibling();
+      past = b.IsPastHighKey(k);
     }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
+    if (past)
+    {
+      held.LockExclusive(right);
+      held.Release(node);
+      node = right;
+      continue;
     }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
-	}
+
+    bool leaf = nodetype == BTREE_LEAF_NODE;
+    if (leaf && found) return ERROR_CONFLICT;
+    if (!full)
+    {
+      rc = InsertKeyValue(node, k, leaf ? value : VALUE_T((SIZE_T)0), ptr, true);
+      //A variable-length leaf without room for this pair after all
+      if (leaf && rc == ERROR_NOSPACE)
+      {
+        exclusive = true;
+        return ERROR_NOERROR;
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
+      return rc;
+    }
+
+    //Split, with the new sibling and a leaf's right neighbour latched
+    //as well, and put k into whichever half it belongs in.  The node
+    //leads on to the sibling at once; its parent finds out below.
+    double fraction = appendsplit && right == 0 && offset == numkeys ? BTREE_APPEND_SPLIT_FILL : 0.5;
+    SIZE_T sibling;
+    KEY_T splittingKey;
+
+    if ((rc = AllocateNode(sibling, node))) return rc;
+    held.LockExclusive(sibling);
+    if ((rc = InitNode(sibling, leaf ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE, format))) return rc;
+    if (leaf && right != 0) held.LockExclusive(right);
+    splittingKey = SplitNode(node, sibling, fraction);
+    if (leaf && right != 0) held.Release(right);
+    if ((rc = InsertKeyValue(CompareKeys(k, splittingKey) > 0 ? sibling : node,
+                             k, leaf ? value : VALUE_T((SIZE_T)0), ptr, true))) return rc;
+    held.ReleaseAll();
+    k = splittingKey;
+    ptr = sibling;
+
+    //Above the level the descent started at, the parent is found down
+    //the left edge from the root.  If the root is still on this level,
+    //either it is node, which grows a new root, or another insert has
+    //split it and is about to.
+    height++;   // now the level k goes into
+    while (path.empty())
+    {
+      held.LockExclusive(superblock_index);
+      SIZE_T root = superblock.info.rootnode;
+      if (root == node)
+      {
+        held.LockExclusive(node);
+        return GrowRoot(node, splittingKey, sibling);
       }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
+      if ((rc = LeftEdgePath(root, height, path))) return rc;
+      held.ReleaseAll();
+      if (path.empty()) sched_yield();
+    }
+    node = path.back();
+    path.pop_back();
+    held.LockExclusive(node);
+  }
+}
+
+ERROR_T BTreeIndex::LeftEdgePath(SIZE_T root, const SIZE_T height, vector<SIZE_T> &path)
+{
+  LatchSet held(latches);
+  PinnedBlock p(buffercache);
+  vector<SIZE_T> edge;
+  SIZE_T node = root;
+  ERROR_T rc;
+
+  //All the way down to the leftmost leaf, since only from there is
+  //it known how far up each node is
+  while (true)
+  {
+    held.LockShared(node);
+    if ((rc = p.Pin(node))) return rc;
+    BTreeNodeView b(p.GetFrame());
+    edge.push_back(node);
+    if (b.info.nodetype == BTREE_LEAF_NODE) break;
+    if ((rc = b.GetPtr(0, node))) return rc;
+    p.Unpin();
+    held.ReleaseAll();
+  }
+  if (edge.size() > height)
+  {
+    path.insert(path.end(), edge.begin(), edge.end()-height);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::MakeRoom(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key,
+			     vector<SIZE_T> &level)
+{
+  ERROR_T rc;
+  SIZE_T sibling;
+  KEY_T splittingKey;
+  bool edge;
+
+  //Ascending inserts only ever add to the rightmost node, so leave
+  //the left one nearly full rather than half empty for good
+  if ((rc = AtRightEdge(node, path, key, edge))) return rc;
+  if (edge)
+  {
+    if ((rc = SplitAndPromote(node, path, sibling, splittingKey, BTREE_APPEND_SPLIT_FILL))) return rc;
+    level.assign(1, node);
+    level.push_back(sibling);
+    return ERROR_NOERROR;
+  }
+
+  if (splitpolicy == BTREE_SPLIT_BSTAR && !path.empty())
+  {
+    rc = ShareOrSplitThree(node, path, key, level);
+    if (rc != ERROR_NOSPACE) return rc;
+  }
+
+  if ((rc = SplitAndPromote(node, path, sibling, splittingKey))) return rc;
+  level.assign(1, node);
+  level.push_back(sibling);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::AtRightEdge(SIZE_T node, const vector<SIZE_T> &path, const KEY_T &key,
+				bool &edge)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+  KEY_T last;
+  SIZE_T ptr;
+
+  edge = false;
+  if (!appendsplit) return ERROR_NOERROR;
+
+  //key has to go after everything in node...
+  if ((rc = p.Pin(node))) return rc;
+  {
+    BTreeNodeView b(p.GetFrame());
+    if (b.info.numkeys == 0) return ERROR_NOERROR;
+    if ((rc = b.GetKey(b.info.numkeys-1, last))) return rc;
+  }
+  if (CompareKeys(key, last) < 0) return ERROR_NOERROR;
+
+  //...and node be the last child of every node above it
+  for (SIZE_T i = path.size(); i > 0; i--)
+  {
+    if ((rc = p.Pin(path[i-1]))) return rc;
+    BTreeNodeView b(p.GetFrame());
+    if ((rc = b.GetPtr(b.info.numkeys, ptr))) return rc;
+    if (ptr != (i == path.size() ? node : path[i])) return ERROR_NOERROR;
+  }
+  edge = true;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::ShareOrSplitThree(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key,
+				      vector<SIZE_T> &level)
+{
+  SIZE_T parentNode = path.back();
+  BTreeNode parent, b;
+  ERROR_T rc;
+
+  if ((rc = parent.Unserialize(buffercache, parentNode)) ||
+      (rc = b.Unserialize(buffercache, node))) return rc;
+
+  SIZE_T offset = nodeops->LowerBound(parent.View(), key);
+  double fill = b.View().GetFill();
+  bool leaf = b.info.nodetype == BTREE_LEAF_NODE;
+
+  //Try the left sibling first, then the right one
+  for (int side = 0; side < 2; side++)
+  {
+    if (side == 0 ? offset == 0 : offset >= parent.info.numkeys) continue;
+    SIZE_T sep = side == 0 ? offset-1 : offset;
+    SIZE_T siblingNode;
+    BTreeNode sibling;
+    KEY_T separator;
+
+    if ((rc = parent.GetPtr(side == 0 ? sep : sep+1, siblingNode))) return rc;
+    if ((rc = sibling.Unserialize(buffercache, siblingNode))) return rc;
+    if ((fill + sibling.View().GetFill())/2 >= BTREE_BSTAR_SHARE_FILL) continue;
+
+    BTreeNode newParent(parent);
+    BTreeNode left(side == 0 ? sibling : b), right(side == 0 ? b : sibling);
+    rc = BorrowEntries(newParent, sep, left, right);
+    if (rc == ERROR_NOSPACE) continue;
+    if (rc) return rc;
+
+    //Only worth it if key now goes into a node with more room than
+    //node had, or a node that keeps running out of room (some
+    //variable-length keys) could be shared back and forth for ever
+    if ((rc = newParent.GetKey(sep, separator))) return rc;
+    BTreeNode &target = CompareKeys(key, separator) <= 0 ? left : right;
+    if (target.View().GetFill() >= fill) continue;
+
+    SIZE_T leftNode = side == 0 ? siblingNode : node;
+    SIZE_T rightNode = side == 0 ? node : siblingNode;
+    if ((rc = left.Serialize(buffercache, leftNode)) ||
+        (rc = right.Serialize(buffercache, rightNode)) ||
+        (rc = newParent.Serialize(buffercache, parentNode))) return rc;
+    level.assign(1, leftNode);
+    level.push_back(rightNode);
+    return ERROR_NOERROR;
+  }
+
+  //Both siblings are about as full, so two leaves become three,
+  //preferably node and the one after it
+  if (!leaf || parent.info.numkeys == 0) return ERROR_NOSPACE;
+  SIZE_T sep = offset < parent.info.numkeys ? offset : offset-1;
+  SIZE_T leftNode, rightNode;
+  BTreeNode left, right;
+  if ((rc = parent.GetPtr(sep, leftNode)) || (rc = parent.GetPtr(sep+1, rightNode))) return rc;
+  if ((rc = left.Unserialize(buffercache, leftNode)) ||
+      (rc = right.Unserialize(buffercache, rightNode))) return rc;
+  return SplitThree(path, parent, sep, leftNode, left, rightNode, right, level);
+}
+
+ERROR_T BTreeIndex::SplitThree(vector<SIZE_T> &path, BTreeNode &parent, const SIZE_T sep,
+			       const SIZE_T leftNode, BTreeNode &left,
+			       const SIZE_T rightNode, BTreeNode &right,
+			       vector<SIZE_T> &level)
+{
+  SIZE_T parentNode = path.back();
+  SIZE_T middleNode;
+  BTreeNode middle(BTREE_LEAF_NODE,
+		   superblock.info.keysize,
+		   superblock.info.valuesize,
+		   buffercache->GetBlockSize());
+  BTreeNodeView l = left.View();
+  BTreeNodeView m = middle.View();
+  BTreeNodeView r = right.View();
+  ERROR_T rc;
+  KEY_T k, first, s1, s2;
+  VALUE_T v;
+
+  //Everything is worked out in memory first, so that running out of
+  //room changes nothing
+  m.info.highkeyroom = l.info.highkeyroom;
+  m.Clear(l.info.format);
+  double third = (l.GetFill() + r.GetFill())/3;
+
+  //The end of left and the start of right make up the middle leaf
+  while (l.GetFill() > third && l.info.numkeys > 1)
+  {
+    SIZE_T last = l.info.numkeys-1;
+    if ((rc = l.GetKey(last,k)) || (rc = l.GetVal(last,v))) return rc;
+    if ((rc = m.InsertKeyVal(0,k,v))) return rc;
+    if ((rc = l.RemoveSlots(last,1))) return rc;
+  }
+  while (m.GetFill() < third && r.info.numkeys > 1)
+  {
+    if ((rc = r.GetKey(0,k)) || (rc = r.GetVal(0,v))) return rc;
+    if ((rc = m.InsertKeyVal(m.info.numkeys,k,v))) return rc;
+    if ((rc = r.RemoveSlots(0,1))) return rc;
+  }
+  if (m.info.numkeys == 0) return ERROR_NOSPACE;
+
+  //The key between left and middle replaces the one between left and
+  //right, and the one between middle and right goes in after it
+  if ((rc = l.GetKey(l.info.numkeys-1,k)) || (rc = m.GetKey(0,first))) return rc;
+  s1 = LeafSeparator(k, first);
+  if ((rc = m.GetKey(m.info.numkeys-1,k)) || (rc = r.GetKey(0,first))) return rc;
+  s2 = LeafSeparator(k, first);
+  if ((rc = parent.View().SetKey(sep,s1))) return rc;
+  if (l.IsLinked()) {
+    if ((rc = l.SetHighKey(s1)) || (rc = m.SetHighKey(s2))) return rc;
+  }
+
+  if ((rc = AllocateNode(middleNode, leftNode))) return rc;
+  if ((rc = parent.View().SetPtr(sep+1,middleNode))) return rc;
+  l.SetRightSibling(middleNode);
+  m.SetLeftSibling(leftNode);
+  m.SetRightSibling(rightNode);
+  r.SetLeftSibling(middleNode);
+  if ((rc = l.Compact()) || (rc = m.Compact()) || (rc = r.Compact())) return rc;
+  if ((rc = left.Serialize(buffercache, leftNode)) ||
+      (rc = middle.Serialize(buffercache, middleNode)) ||
+      (rc = right.Serialize(buffercache, rightNode)) ||
+      (rc = parent.Serialize(buffercache, parentNode))) return rc;
+
+  level.assign(1, leftNode);
+  level.push_back(middleNode);
+  level.push_back(rightNode);
+
+  //right goes back into the parent to the right of middle
+  path.pop_back();
+  return InsertInternalRecursive(parentNode, path, s2, VALUE_T((SIZE_T)0), rightNode);
+}
+
+ERROR_T BTreeIndex::makeTree(BTreeNode referenceNode, KEY_T key, VALUE_T value)
+{
+  ERROR_T rc;
+
+  //Make new leaf node
+  SIZE_T newLeafNode1;
+  if ((rc = AllocateNode(newLeafNode1, superblock.info.rootnode))) return rc;
+  if ((rc = InitNode(newLeafNode1, BTREE_LEAF_NODE, GetNodeFormat(BTREE_LEAF_NODE)))) return rc;
+  //Insert key/value into leaf node
+  if ((rc = InsertKeyValue(newLeafNode1, key, value, (SIZE_T)0, false))) return rc;
+  //Insert leaf node pointer into root (using input key as splitting key) (LHS)
+  if ((rc = InsertKeyValue(superblock.info.rootnode, key, VALUE_T((SIZE_T)0), newLeafNode1, false))) return rc;
+
+  //Make Second new leaf node
+  SIZE_T newLeafNode2;
+  if ((rc = AllocateNode(newLeafNode2, newLeafNode1))) return rc;
+  if ((rc = InitNode(newLeafNode2, BTREE_LEAF_NODE, GetNodeFormat(BTREE_LEAF_NODE)))) return rc;
+  //Insert leaf node pointer into root (using input key as splitting key) (RHS)
+  if ((rc = InsertKeyValue(superblock.info.rootnode, key, VALUE_T((SIZE_T)0), newLeafNode2, true))) return rc;
+
+  //Chain the two leaves together
+  PinnedBlock p1(buffercache);
+  PinnedBlock p2(buffercache);
+  if ((rc = p1.Pin(newLeafNode1)) || (rc = p2.Pin(newLeafNode2))) return rc;
+  BTreeNodeView(p1.GetFrame()).SetRightSibling(newLeafNode2);
+  BTreeNodeView(p2.GetFrame()).SetLeftSibling(newLeafNode1);
+  if (BTreeNodeView(p1.GetFrame()).IsLinked()) {
+    if ((rc = BTreeNodeView(p1.GetFrame()).SetHighKey(key))) return rc;
+  }
+  p1.MarkDirty();
+  p2.MarkDirty();
+
+  return ERROR_NOERROR;
+}
+
+SIZE_T BTreeIndex::FindLeaf(const KEY_T &key, vector<SIZE_T> &path)
+{
+  SIZE_T leaf;
+  KEY_T bound;
+  bool bounded;
+
+  //0 if there is no leaf to find
+  if (FindLeafBound(key, leaf, path, bound, bounded)) return 0;
+  return leaf;
+}
+
+ERROR_T BTreeIndex::DescendTo(const KEY_T &key, const vector<SIZE_T> &level,
+			      SIZE_T &node, vector<SIZE_T> &path)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+
+  path.clear();
+  node = superblock.info.rootnode;
+
+  while (find(level.begin(), level.end(), node) == level.end())
+  {
+    if ((rc = p.Pin(node))) return rc;
+    BTreeNodeView b(p.GetFrame());
+
+    //Got to the bottom without passing any of them
+    if (b.info.nodetype == BTREE_LEAF_NODE) return ERROR_INSANE;
+
+    path.push_back(node);
+    if ((rc = b.GetPtr(nodeops->LowerBound(b,key),node))) return rc;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::FindLeafBound(const KEY_T &key, SIZE_T &leaf, vector<SIZE_T> &path,
+				  KEY_T &bound, bool &bounded)
+{
+  PinnedBlock p(buffercache);
+
+  return FindLeafBound(key, leaf, path, bound, bounded, p);
+}
+
+ERROR_T BTreeIndex::FindLeafBound(const KEY_T &key, SIZE_T &leaf, vector<SIZE_T> &path,
+				  KEY_T &bound, bool &bounded, PinnedBlock &p)
+{
+  ERROR_T rc;
+  SIZE_T offset, child;
+
+  leaf = superblock.info.rootnode;
+  bounded = false;
+  path.clear();
+
+  while (true)
+  {
+    //Interior nodes already decoded cost only the compares; others are
+    //read, and decoded for next time unless it is a leaf.  The key to
+    //the right of the pointer followed caps what is below it; the
+    //deeper the tighter.
+    if (nodecache.Find(leaf, key, child, &bound, &bounded))
+    {
+      path.push_back(leaf);
+      leaf = child;
+      continue;
+    }
+
+    if ((rc = p.Pin(leaf))) return rc;
+    BTreeNodeView b(p.GetFrame());
+    if (b.info.nodetype == BTREE_LEAF_NODE) return ERROR_NOERROR;
+
+    //An empty root has no leaves at all
+    if (b.info.numkeys == 0) return ERROR_NONEXISTENT;
+
+    nodecache.Insert(leaf, b, path.size());
+    path.push_back(leaf);
+    offset = nodeops->LowerBound(b,key);
+    if (offset < b.info.numkeys)
+    {
+      if ((rc = b.GetKey(offset,bound))) return rc;
+      bounded = true;
+    }
+    if ((rc = b.GetPtr(offset,leaf))) return rc;
+  }
+}
+
+ERROR_T BTreeIndex::InsertKeyValue(SIZE_T node, KEY_T key, VALUE_T value, SIZE_T newNode, bool rhs)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+
+  //Get node from pointer
+  if ((rc = p.Pin(node))) return rc;
+
+  //Edits happen in place in the cached frame
+  BTreeNodeView b(p.GetFrame());
+   
+  //Find place in key list
+  SIZE_T offset = nodeops->LowerBound(b,key);
+  bool found = offset<b.info.numkeys && nodeops->CompareKey(b,offset,key)==0;
+
+  switch(b.info.nodetype)
+  {
+    //If leaf node
+    case BTREE_LEAF_NODE:
+
+      if (found)
+      {
+        return ERROR_CONFLICT;
+      }
+
+      //Shift everything after offset over by one slot and fill the gap
+      if ((rc = b.InsertKeyVal(offset,key,value))) return rc;
+      p.MarkDirty();
+      {
+        lock_guard<mutex> hold(superblock_lock);
+        superblock.info.numkeys++;
+        superblock_dirty=true;
+      }
+
+      return ERROR_NOERROR;
+
+    //If root or interior node
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+
+      //The key is already here, so only the pointer changes
+      if (found)
+      {
+        p.MarkDirty();
+        //If passed in value == 1, add to the rhs
+        if(rhs)
+        {
+          if ((rc = b.SetPtr(offset+1,newNode))) return rc;
+        }
+        //If passed in value == 0, add to the lfs
+        else
+        {
+          if ((rc = b.SetPtr(offset,newNode))) return rc;
+        }
+        return ERROR_NOERROR;
+      }
+
+      //If passed in value == 1, add to the rhs
+      if(rhs)
+      {
+        if ((rc = b.InsertKeyPtr(offset,key,newNode))) return rc;
+      }
+      //If passed in value == 0, add to the lhs, moving the
+      //pointer that was there to the right of the new key
+      else
+      {
+        SIZE_T ptr;
+        if ((rc = b.GetPtr(offset,ptr))) return rc;
+        if ((rc = b.InsertKeyPtr(offset,key,ptr))) return rc;
+        if ((rc = b.SetPtr(offset,newNode))) return rc;
+      }
+      p.MarkDirty();
+      {
+        lock_guard<mutex> hold(superblock_lock);
+        superblock.info.numkeys++;
+        superblock_dirty=true;
+      }
+      return ERROR_NOERROR;
+
+    //If node of these types, error
+    default:
+      return ERROR_INSANE;
+  }
+}
+
+//
+// The shortest key s with left <= s < right, in node order (where
+// trailing zeros do not count): right cut off one byte after where the
+// two first differ, unless all that is cut off is zeros, and otherwise
+// left without its trailing zeros
+//
+static KEY_T ShortestSeparator(const KEY_T &left, const KEY_T &right)
+{
+  SIZE_T common, len, i;
+
+  for (common=0;
+       common<right.length && (common<left.length ? left.data[common] : 0)==right.data[common];
+       common++) {
+  }
+
+  len=common+1;
+  for (i=len;i<right.length;i++) {
+    if (right.data[i]) {
+      KEY_T s(len);
+      memcpy(s.data,right.data,len);
+      return s;
+    }
+  }
+
+  for (len=left.length;len>0 && left.data[len-1]==0;len--) {
+  }
+  KEY_T s(len);
+  memcpy(s.data,left.data,len);
+  return s;
+}
+
+KEY_T BTreeIndex::LeafSeparator(const KEY_T &left, const KEY_T &right) const
+{
+  //Interior keys can be any length under TRUNCATE, so the shortest
+  //key that still tells the two apart will do
+  if (superblock.info.format & BTREE_OPT_TRUNCATE)
+  {
+    return ShortestSeparator(left, right);
+  }
+  return left;
+}
+
+void BTreeIndex::SetSplitPolicy(const BTreeSplitPolicy policy, const bool append)
+{
+  splitpolicy = policy;
+  appendsplit = append;
+}
+
+void BTreeIndex::SetTopDownInsert(const bool on)
+{
+  topdown = on;
+}
+
+void BTreeIndex::SetNodeCacheSize(const SIZE_T nodes)
+{
+  nodecache.SetCapacity(nodes);
+}
+
+void BTreeIndex::SetConcurrent(const bool on, const bool olc)
+{
+  concurrent = on;
+  optimistic = on && olc;
+}
+
+KEY_T BTreeIndex::SplitNode(SIZE_T node, SIZE_T newNode, const double fraction)
+{
+  PinnedBlock p(buffercache);
+  PinnedBlock pNew(buffercache);
+  ERROR_T rc;
+  SIZE_T tempPtr;
+
+  //Get the input node
+  if((rc = p.Pin(node))) return KEY_T((SIZE_T)0);
+  //Get the input new node
+  if((rc = pNew.Pin(newNode))) return KEY_T((SIZE_T)0);
+
+  //Both nodes are edited in place
+  BTreeNodeView b(p.GetFrame());
+  BTreeNodeView bNew(pNew.GetFrame());
+  p.MarkDirty();
+  pNew.MarkDirty();
+
+  //Get index of the split point (by bytes, if entries vary in size)
+  SIZE_T halfOffset = b.GetSplitOffset(fraction);
+  //Get splitting key (last key to be left in original node)
+  KEY_T splittingKey;
+  if((rc=b.GetKey(halfOffset-1,splittingKey))) return KEY_T((SIZE_T)0);
+
+  if(b.info.nodetype == BTREE_LEAF_NODE)
+  {
+    //Move the upper half of the key-value pairs over in one go
+    if((rc=b.MoveSlots(halfOffset,bNew))) return KEY_T((SIZE_T)0);
+
+    //The new leaf goes into the chain just to the right of this one
+    SIZE_T right = b.GetRightSibling();
+    bNew.SetLeftSibling(node);
+    bNew.SetRightSibling(right);
+    b.SetRightSibling(newNode);
+    if(right != 0)
+    {
+      PinnedBlock pRight(buffercache);
+      if((rc = pRight.Pin(right))) return KEY_T((SIZE_T)0);
+      BTreeNodeView(pRight.GetFrame()).SetLeftSibling(newNode);
+      pRight.MarkDirty();
+    }
+
+    //Interior keys can be any length, so promote the shortest key
+    //that still separates the halves instead of the whole left key
+    if(superblock.info.format & BTREE_OPT_TRUNCATE)
+    {
+      KEY_T rightKey;
+      if((rc=bNew.GetKey(0,rightKey))) return KEY_T((SIZE_T)0);
+      splittingKey = ShortestSeparator(splittingKey, rightKey);
+    }
+  }
+
+  else if(b.info.nodetype == BTREE_INTERIOR_NODE || b.info.nodetype == BTREE_ROOT_NODE)
+  {
+    //The new node starts with the pointer to the right of the
+    //splitting key, followed by every slot after the splitting key
+    if((rc=b.GetPtr(halfOffset,tempPtr))) return KEY_T((SIZE_T)0);
+    if((rc=b.MoveSlots(halfOffset,bNew))) return KEY_T((SIZE_T)0);
+    if((rc=bNew.SetPtr(0,tempPtr))) return KEY_T((SIZE_T)0);
+
+    //The splitting key itself moves up into the parent, so the
+    //original node keeps only the keys before it
+    if((rc=b.RemoveSlots(halfOffset-1,1))) return KEY_T((SIZE_T)0);
+  }
+
+  //B-link: the new node takes over the high key (and, between interior
+  //nodes, the link to the right), and this one now ends at the
+  //splitting key and leads on to the new one
+  if(b.IsLinked())
+  {
+    KEY_T high;
+    if(b.HasHighKey())
+    {
+      if((rc=b.GetHighKey(high)) || (rc=bNew.SetHighKey(high))) return KEY_T((SIZE_T)0);
+    }
+    if(b.info.nodetype != BTREE_LEAF_NODE)
+    {
+      bNew.SetRightSibling(b.GetRightSibling());
+      b.SetRightSibling(newNode);
+    }
+    if((rc=b.SetHighKey(splittingKey))) return KEY_T((SIZE_T)0);
+  }
+
+  //Each half may now share a longer prefix than the whole did
+  if((rc=b.Compact())) return KEY_T((SIZE_T)0);
+  if((rc=bNew.Compact())) return KEY_T((SIZE_T)0);
+
+  return splittingKey;
+}
+
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt,
+			 const BTreeIndex &index)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	index.PrintKey(os,key);
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << "(";
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      index.PrintKey(os,key);
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ",";
+      } else {
+	os << " ";
+      }
+      rc=b.GetVal(offset,value);
+      if (rc) {  return rc; }
+      for (i=0;i<value.length;i++) { 
+	os << value.data[i];
+      }
+      if (dt==BTREE_SORTED_KEYVAL) { 
+	os << ")\n";
+      } else {
+	os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+//
+// Integer keys are stored big-endian, so memcmp order is numeric
+// order.  Signed ones get their sign bit flipped first, which puts
+// the negative numbers below the rest.
+//
+static void EncodeIntKey(unsigned long long x, const bool flip, KEY_T &key)
+{
+  if (flip) { 
+    x^=0x8000000000000000ULL;
+  }
+  key.Resize(8,false);
+  for (int i=7;i>=0;i--) { 
+    key.data[i]=(BYTE_T)(x&0xff);
+    x>>=8;
+  }
+}
+
+static unsigned long long DecodeIntKey(const KEY_T &key, const bool flip)
+{
+  unsigned long long x=0;
+
+  for (SIZE_T i=0;i<8 && i<key.length;i++) { 
+    x=(x<<8)|key.data[i];
+  }
+  return flip ? x^0x8000000000000000ULL : x;
+}
+
+ERROR_T BTreeIndex::ParseKey(const char *text, KEY_T &key) const
+{
+  char *end;
+
+  errno=0;
+  if (superblock.info.format & BTREE_OPT_INTKEYS) { 
+    long long x=strtoll(text,&end,10);
+    if (end==text || *end || errno) { 
+      return ERROR_SIZE;
+    }
+    EncodeIntKey((unsigned long long)x,true,key);
+  } else if (superblock.info.format & BTREE_OPT_UINTKEYS) { 
+    unsigned long long x=strtoull(text,&end,10);
+    if (end==text || *end || errno || *text=='-') { 
+      return ERROR_SIZE;
+    }
+    EncodeIntKey(x,false,key);
+  } else {
+    key=KEY_T(text);
+  }
+  return ERROR_NOERROR;
+}
+
+ostream & BTreeIndex::PrintKey(ostream &os, const KEY_T &key) const
+{
+  if (superblock.info.format & BTREE_OPT_INTKEYS) { 
+    os << (long long)DecodeIntKey(key,true);
+  } else if (superblock.info.format & BTREE_OPT_UINTKEYS) { 
+    os << DecodeIntKey(key,false);
+  } else {
+    for (SIZE_T i=0;i<key.length;i++) { 
+      os << key.data[i];
+    }
+  }
+  return os;
+}
+  
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  if (concurrent)
+  {
+    TreeLock shared(treelock, true, true);
+    return LookupOrUpdateLatched(BTREE_OP_LOOKUP, key, value);
+  }
+  return LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
+}
+
+//
+// Orders positions in a batch of keys by the keys there
+//
+struct KeyIndexLess {
+  const vector<KEY_T> *keys;
+  bool operator()(const SIZE_T a, const SIZE_T b) const { 
+    return CompareKeys((*keys)[a],(*keys)[b])<0;
+  }
+};
+
+//
+// Orders positions in a batch of pairs by the keys there
+//
+struct PairIndexLess {
+  const vector<KeyValuePair> *pairs;
+  bool operator()(const SIZE_T a, const SIZE_T b) const { 
+    return CompareKeys((*pairs)[a].key,(*pairs)[b].key)<0;
+  }
+};
+
+ERROR_T BTreeIndex::InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+  TreeLock whole(treelock, concurrent);
+  return ApplyBatch(pairs, results, BTREE_OP_INSERT);
+}
+
+ERROR_T BTreeIndex::UpdateBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+  TreeLock whole(treelock, concurrent);
+  return ApplyBatch(pairs, results, BTREE_OP_UPDATE);
+}
+
+ERROR_T BTreeIndex::ApplyBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results,
+			       const BTreeOp op)
+{
+  ERROR_T rc;
+  vector<SIZE_T> order(pairs.size());
+  SIZE_T i = 0;
+  SIZE_T n = pairs.size();
+
+  results.assign(n, ERROR_NOERROR);
+
+  //Sort once; equal keys stay in their original order, so the first
+  //of them is the one that goes in
+  for (SIZE_T j = 0; j < n; j++) order[j] = j;
+  PairIndexLess less = { &pairs };
+  stable_sort(order.begin(), order.end(), less);
+
+  //The very first insert builds the tree
+  if (n > 0 && op == BTREE_OP_INSERT)
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(superblock.info.rootnode))) return rc;
+    if (BTreeNodeView(p.GetFrame()).info.numkeys == 0)
+    {
+      p.Unpin();
+      results[order[0]] = InsertInternal(pairs[order[0]].key, pairs[order[0]].value);
+      i = 1;
+    }
+  }
+
+  while (i < n)
+  {
+    SIZE_T leaf;
+    KEY_T bound;
+    bool bounded;
+    bool split = false;
+    SIZE_T splitAt = order[i];
+    vector<SIZE_T> path;
+
+    rc = FindLeafBound(pairs[order[i]].key, leaf, path, bound, bounded);
+    if (rc == ERROR_NONEXISTENT)
+    {
+      //Nothing to update in an empty tree
+      for (; i < n; i++) results[order[i]] = ERROR_NONEXISTENT;
+      break;
+    }
+    if (rc) return rc;
+
+    //Every pair from here up to the bound goes in this leaf, changed
+    //in place under one pin until it has to split
+    {
+      PinnedBlock p(buffercache);
+      if ((rc = p.Pin(leaf))) return rc;
+      BTreeNodeView b(p.GetFrame());
+
+      while (i < n && !split)
+      {
+        const KeyValuePair &kv = pairs[order[i]];
+        if (bounded && CompareKeys(kv.key, bound) > 0) break;
+
+        SIZE_T offset = nodeops->LowerBound(b,kv.key);
+        bool found = offset<b.info.numkeys && nodeops->CompareKey(b,offset,kv.key)==0;
+
+        if (op == BTREE_OP_UPDATE)
+        {
+          rc = found ? b.SetVal(offset, kv.value) : ERROR_NONEXISTENT;
+        }
+        else
+        {
+          rc = found ? ERROR_CONFLICT : b.InsertKeyVal(offset, kv.key, kv.value);
+        }
+
+        //No room for this one: split, then try it again
+        splitAt = order[i];
+        if (rc == ERROR_NOSPACE)
+        {
+          split = true;
+          break;
+        }
+        results[order[i++]] = rc;
+        if (rc) continue;
+        p.MarkDirty();
+
+        if (op == BTREE_OP_INSERT)
+        {
+          superblock.info.numkeys++;
+          superblock_dirty = true;
+          //Split as soon as a single insert would
+          split = NeedsSplit(b);
+        }
+      }
+    }
+
+    //The rest of the pairs find their halves from the parent
+    if (split)
+    {
+      vector<SIZE_T> level;
+      if ((rc = MakeRoom(leaf, path, pairs[splitAt].key, level))) return rc;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+//
+// A node that MultiGet has yet to visit, with the run of (sorted)
+// keys that lead to it
+//
+struct MultiGetStep {
+  SIZE_T node;
+  SIZE_T begin;
+  SIZE_T end;
+};
+
+ERROR_T BTreeIndex::MultiGet(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+			     vector<ERROR_T> &results)
+{
+  TreeLock whole(treelock, concurrent);
+  ERROR_T rc;
+  vector<SIZE_T> order(keys.size());
+  vector<MultiGetStep> level, next;
+  SIZE_T window = buffercache->GetCacheSize()/2;
+
+  values.assign(keys.size(), VALUE_T());
+  results.assign(keys.size(), ERROR_NONEXISTENT);
+  if (keys.empty()) return ERROR_NOERROR;
+  if (window == 0) window = 1;
+
+  //Sort the keys once, remembering where each came from
+  for (SIZE_T i = 0; i < order.size(); i++) order[i] = i;
+  KeyIndexLess less = { &keys };
+  stable_sort(order.begin(), order.end(), less);
+
+  MultiGetStep root = { superblock.info.rootnode, 0, (SIZE_T)keys.size() };
+  level.push_back(root);
+
+  while (!level.empty())
+  {
+    next.clear();
+    //Read the nodes of this level in together, as many at a time as
+    //the cache can hold without losing the earlier ones
+    for (SIZE_T start = 0; start < level.size(); start += window)
+    {
+      SIZE_T stop = start+window < level.size() ? start+window : level.size();
+      vector<SIZE_T> blocks;
+      for (SIZE_T i = start; i < stop; i++) blocks.push_back(level[i].node);
+      rc = buffercache->PrefetchBlocks(blocks);
+      if (rc && rc != ERROR_NOFETCH) return rc;
+
+      for (SIZE_T i = start; i < stop; i++)
+      {
+        PinnedBlock p(buffercache);
+        if ((rc = p.Pin(level[i].node))) return rc;
+        BTreeNodeView b(p.GetFrame());
+
+        if (b.info.nodetype == BTREE_LEAF_NODE)
+        {
+          for (SIZE_T j = level[i].begin; j < level[i].end; j++)
+          {
+            const KEY_T &key = keys[order[j]];
+            SIZE_T offset = nodeops->LowerBound(b,key);
+            if (offset < b.info.numkeys && nodeops->CompareKey(b,offset,key) == 0)
+            {
+              results[order[j]] = b.GetVal(offset,values[order[j]]);
+            }
+          }
+          continue;
+        }
+        //An empty root has nothing under it
+        if (b.info.numkeys == 0) continue;
+
+        //Sorted keys that go down the same pointer are next to each other
+        SIZE_T j = level[i].begin;
+        while (j < level[i].end)
+        {
+          MultiGetStep child;
+          SIZE_T offset = nodeops->LowerBound(b,keys[order[j]]);
+          if ((rc = b.GetPtr(offset,child.node))) return rc;
+          child.begin = j;
+          while (++j < level[i].end && nodeops->LowerBound(b,keys[order[j]]) == offset) { }
+          child.end = j;
+          next.push_back(child);
+        }
+      }
+    }
+    level.swap(next);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::ReadAhead(const KEY_T &key, const KEY_T &hi, vector<SIZE_T> &ahead)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+  SIZE_T node = superblock.info.rootnode;
+  SIZE_T parent = 0;
+  SIZE_T offset = 0;
+  SIZE_T child;
+  SIZE_T window = buffercache->GetCacheSize()/4;
+
+  ahead.clear();
+  if (window > BTREE_SCAN_READAHEAD) window = BTREE_SCAN_READAHEAD;
+
+  //Down to the parent of the leaf for key
+  if ((rc = p.Pin(node))) return rc;
+  while (true)
+  {
+    BTreeNodeView b(p.GetFrame());
+    if (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0) break;
+    parent = node;
+    offset = nodeops->LowerBound(b,key);
+    if ((rc = b.GetPtr(offset,node)) || (rc = p.Pin(node))) return rc;
+  }
+  if (parent == 0) return ERROR_NOERROR;
+
+  //Child i holds the keys after key i-1, so none of them are <= hi
+  //once key i-1 is at least hi
+  if ((rc = p.Pin(parent))) return rc;
+  BTreeNodeView b(p.GetFrame());
+  for (SIZE_T i = offset+1; i <= b.info.numkeys && ahead.size() < window; i++)
+  {
+    if (nodeops->CompareKey(b,i-1,hi) >= 0) break;
+    if ((rc = b.GetPtr(i,child))) return rc;
+    ahead.push_back(child);
+  }
+
+  //Read-ahead is only a hint; a full cache just means less of it
+  rc = buffercache->PrefetchBlocks(ahead);
+  return rc == ERROR_NOFETCH ? ERROR_NOERROR : rc;
+}
+
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const KEY_T &hi, const SIZE_T limit,
+			 BTreeScanFn fn, void *arg)
+{
+  TreeLock whole(treelock, concurrent);
+  BTreeCursor c(*this);
+  KEY_T key;
+  VALUE_T value;
+  vector<SIZE_T> ahead;
+  SIZE_T leaf = 0;
+  SIZE_T count = 0;
+  ERROR_T rc;
+
+  for (rc = c.Seek(lo); rc == ERROR_NOERROR; rc = c.Next())
+  {
+    if ((rc = c.Key(key))) return rc;
+    if (CompareKeys(key,hi) > 0) return ERROR_NOERROR;
+
+    //Read ahead again on reaching the last leaf read ahead, or a leaf
+    //that was not read ahead at all (the first, or one past the parent)
+    if (c.leaf != leaf)
+    {
+      leaf = c.leaf;
+      if (find(ahead.begin(),ahead.end(),leaf) == ahead.end() || leaf == ahead.back())
+      {
+        if ((rc = ReadAhead(key,hi,ahead))) return rc;
+      }
+    }
+
+    if ((rc = c.Value(value)) || (rc = fn(key,value,arg))) return rc;
+    if (limit > 0 && ++count >= limit) return ERROR_NOERROR;
+  }
+  return rc == ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+ERROR_T BTreeIndex::LoadLeaves(BTreeLoadFn fn, void *arg, const double fill,
+			       vector<SIZE_T> &nodes, vector<KEY_T> &seps,
+			       vector<SIZE_T> &built, SIZE_T &numkeys)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+  KEY_T key, last;
+  VALUE_T value;
+  SIZE_T leaf = 0;
+  SIZE_T next;
+  SIZE_T format = GetNodeFormat(BTREE_LEAF_NODE);
+
+  while ((rc = fn(key, value, arg)) == ERROR_NOERROR)
+  {
+    bool placed = false;
+
+    if (leaf != 0)
+    {
+      BTreeNodeView b(p.GetFrame());
+
+      if (CompareKeys(key, last) <= 0) return ERROR_NOORDER;
+
+      //Append to this leaf while it is not yet full enough
+      if (b.GetFill() < fill)
+      {
+        rc = b.InsertKeyVal(b.info.numkeys, key, value);
+        if (rc && rc != ERROR_NOSPACE) return rc;
+        placed = (rc == ERROR_NOERROR);
+      }
+    }
+
+    //Otherwise start the next leaf, in the next block along
+    if (!placed)
+    {
+      if ((rc = AllocateNode(next, leaf != 0 ? leaf : superblock.info.rootnode))) return rc;
+      if ((rc = InitNode(next, BTREE_LEAF_NODE, format))) return rc;
+      built.push_back(next);
+
+      if (leaf != 0)
+      {
+        BTreeNodeView b(p.GetFrame());
+        b.SetRightSibling(next);
+        if ((rc = b.Compact())) return rc;
+        seps.push_back((superblock.info.format & BTREE_OPT_TRUNCATE) ?
+                       ShortestSeparator(last, key) : last);
+      }
+
+      if ((rc = p.Pin(next))) return rc;
+      p.MarkDirty();
+      BTreeNodeView b(p.GetFrame());
+      b.SetLeftSibling(leaf);
+      if ((rc = b.InsertKeyVal(0, key, value))) return rc;
+      nodes.push_back(next);
+      leaf = next;
+    }
+
+    numkeys++;
+    last = key;
+  }
+  if (rc != ERROR_NONEXISTENT) return rc;
+  if (leaf == 0) return ERROR_NOERROR;
+
+  if ((rc = BTreeNodeView(p.GetFrame()).Compact())) return rc;
+
+  //A root needs two children, so a lone leaf gets an empty right
+  //sibling, as the first insert into an empty index gives it
+  if (nodes.size() == 1)
+  {
+    if ((rc = AllocateNode(next, leaf))) return rc;
+    if ((rc = InitNode(next, BTREE_LEAF_NODE, format))) return rc;
+    built.push_back(next);
+    BTreeNodeView(p.GetFrame()).SetRightSibling(next);
+    if ((rc = p.Pin(next))) return rc;
+    p.MarkDirty();
+    BTreeNodeView(p.GetFrame()).SetLeftSibling(leaf);
+    seps.push_back(last);
+    nodes.push_back(next);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BuildLevel(vector<SIZE_T> &nodes, vector<KEY_T> &seps, const double fill,
+			       vector<SIZE_T> &built, SIZE_T &numkeys)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+  vector<SIZE_T> upnodes;
+  vector<KEY_T> upseps;
+  SIZE_T format = GetNodeFormat(BTREE_INTERIOR_NODE);
+  SIZE_T m = nodes.size();
+  SIZE_T i = 0;
+  SIZE_T node = nodes.back();
+
+  while (i < m)
+  {
+    //Each node starts with two children and the key between them
+    if ((rc = AllocateNode(node, node))) return rc;
+    if ((rc = InitNode(node, BTREE_INTERIOR_NODE, format))) return rc;
+    built.push_back(node);
+    if ((rc = p.Pin(node))) return rc;
+    p.MarkDirty();
+    BTreeNodeView b(p.GetFrame());
+    if ((rc = b.InsertKeyPtr(0, seps[i], nodes[i+1])) || (rc = b.SetPtr(0, nodes[i]))) return rc;
+    i += 2;
+
+    //and takes more until it is full enough, except that it never
+    //leaves a single child over for a node of its own
+    while (i < m && (b.GetFill() < fill || i+1 == m))
+    {
+      rc = b.InsertKeyPtr(b.info.numkeys, seps[i-1], nodes[i]);
+      if (rc == ERROR_NOSPACE)
+      {
+        //No room for the very last child, so the next node takes it
+        //and this one's last as well
+        if (i+1 == m)
+        {
+          if (b.info.numkeys < 2) return ERROR_NOSPACE;
+          if ((rc = b.RemoveSlots(b.info.numkeys-1, 1))) return rc;
+          i--;
+        }
+        break;
+      }
+      if (rc) return rc;
+      i++;
+    }
+    if ((rc = b.Compact())) return rc;
+
+    numkeys += b.info.numkeys;
+    upnodes.push_back(node);
+    //The key between two children in different nodes goes up a level
+    if (i < m) upseps.push_back(seps[i-1]);
+  }
+
+  nodes.swap(upnodes);
+  seps.swap(upseps);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::LinkLevel(const vector<SIZE_T> &nodes, const vector<KEY_T> &seps)
+{
+  PinnedBlock p(buffercache);
+  ERROR_T rc;
+
+  //Each node ends at the key between it and the next, and leads on to
+  //it; the last one has no high key
+  for (SIZE_T j = 0; j+1 < nodes.size(); j++)
+  {
+    if ((rc = p.Pin(nodes[j]))) return rc;
+    p.MarkDirty();
+    BTreeNodeView b(p.GetFrame());
+    b.SetRightSibling(nodes[j+1]);
+    if ((rc = b.SetHighKey(seps[j]))) return rc;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BulkLoad(BTreeLoadFn fn, void *arg, const double fill)
+{
+  TreeLock whole(treelock, concurrent);
+  ERROR_T rc;
+  vector<SIZE_T> nodes;   // one level, left to right
+  vector<KEY_T> seps;     // seps[j] separates nodes[j] from nodes[j+1]
+  vector<SIZE_T> built;   // every node made so far
+  SIZE_T numkeys = 0;
+  SIZE_T oldroot = superblock.info.rootnode;
+
+  if (fill <= 0 || fill > 1) return ERROR_BADCONFIG;
+
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(oldroot))) return rc;
+    if (BTreeNodeView(p.GetFrame()).info.numkeys != 0) return ERROR_CONFLICT;
+  }
+
+  //Leaves first, then a level at a time up to a single node
+  rc = LoadLeaves(fn, arg, fill, nodes, seps, built, numkeys);
+  while (rc == ERROR_NOERROR && nodes.size() > 1)
+  {
+    if (superblock.info.format & BTREE_OPT_BLINK) rc = LinkLevel(nodes, seps);
+    if (rc == ERROR_NOERROR) rc = BuildLevel(nodes, seps, fill, built, numkeys);
+  }
+
+  //Nothing was published, so giving the nodes back undoes it all
+  if (rc)
+  {
+    for (SIZE_T i = 0; i < built.size(); i++) DeallocateNode(built[i]);
+    return rc;
+  }
+  if (nodes.empty()) return ERROR_NOERROR;
+
+  //The top node becomes the root, in place of the empty one
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(nodes[0]))) return rc;
+    BTreeNodeView(p.GetFrame()).info.nodetype = BTREE_ROOT_NODE;
+    p.MarkDirty();
+  }
+  //Publish the new root only once it is on disk
+  if ((rc = buffercache->FlushBlock(nodes[0]))) return rc;
+  superblock.info.rootnode = nodes[0];
+  superblock.info.numkeys += numkeys;
+  superblock_dirty = true;
+  if ((rc = DeallocateNode(oldroot))) return rc;
+  return WriteSuperblock();
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  //Latched inserts hand over those they cannot do to the exclusive
+  //path; prefix-compressed nodes may not take a key they seemed to
+  //have room for, so those indexes always go that way
+  if (concurrent && !(superblock.info.format & BTREE_OPT_PREFIX))
+  {
+    TreeLock shared(treelock, true, true);
+    bool exclusive = false;
+    ERROR_T rc = (superblock.info.format & BTREE_OPT_BLINK) ?
+      InsertBlink(key, value, exclusive) : InsertLatched(key, value, exclusive);
+    if (!exclusive) return rc;
+  }
+  TreeLock whole(treelock, concurrent);
+  return InsertInternal(key, value);
+}
+
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value)
+{
+  // WRITE ME
+
+  // Call the internal insert function with node == 0
+
+  if (topdown) return InsertTopDown(key, value);
+
+  vector<SIZE_T> path;
+  return InsertInternalRecursive(0, path, key, value, 0);
+}
+  
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  //A value that does not fit where it is takes the exclusive path
+  if (concurrent)
+  {
+    TreeLock shared(treelock, true, true);
+    ERROR_T rc = LookupOrUpdateLatched(BTREE_OP_UPDATE, key, (VALUE_T&)value);
+    if (rc != ERROR_NOSPACE) return rc;
+  }
+  TreeLock whole(treelock, concurrent);
+  return UpdateInternal(key, value);
+}
+
+ERROR_T BTreeIndex::UpdateInternal(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  rc = LookupOrUpdateInternal(BTREE_OP_UPDATE, key, (VALUE_T&)value);
+
+  //A longer value may not fit in a variable-length leaf; split it and try again
+  if (rc == ERROR_NOSPACE)
+  {
+    vector<SIZE_T> path;
+    SIZE_T leaf = FindLeaf(key, path);
+    if (leaf == 0) return ERROR_INSANE;
+    vector<SIZE_T> level;
+    if ((rc = MakeRoom(leaf, path, key, level))) return rc;
+    return UpdateInternal(key, value);
+  }
+  return rc;
+}
+
+  
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  TreeLock whole(treelock, concurrent);
+  ERROR_T rc;
+  vector<SIZE_T> path;
+  SIZE_T leaf;
+  bool under;
+
+  //Nothing to delete from an empty tree
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(superblock.info.rootnode))) return rc;
+    if (BTreeNodeView(p.GetFrame()).info.numkeys == 0) return ERROR_NONEXISTENT;
+  }
+
+  //Find the leaf node that would contain key, and the way down to it
+  leaf = FindLeaf(key, path);
+  if (leaf == 0) return ERROR_INSANE;
+
+  //Close up the pair's slot in place
+  {
+    PinnedBlock p(buffercache);
+    if ((rc = p.Pin(leaf))) return rc;
+    BTreeNodeView b(p.GetFrame());
+
+    SIZE_T offset = nodeops->LowerBound(b,key);
+    if (offset >= b.info.numkeys || nodeops->CompareKey(b,offset,key) != 0)
+    {
+      return ERROR_NONEXISTENT;
+    }
+    if ((rc = b.RemoveSlots(offset,1))) return rc;
+    p.MarkDirty();
+    superblock.info.numkeys--;
+    superblock_dirty = true;
+
+    under = IsUnderfull(b);
+  }
+
+  return under ? Rebalance(leaf, path, key) : ERROR_NOERROR;
+}
+
+void BTreeIndex::SetUnderflowFill(const double fill)
+{
+  underflow = fill;
+}
+
+bool BTreeIndex::IsUnderfull(const BTreeNodeView &b) const
+{
+  return b.info.numkeys == 0 || b.GetFill() < underflow;
+}
+
+ERROR_T BTreeIndex::Rebalance(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key)
+{
+  BTreeNode parent, left, right;
+  ERROR_T rc;
+  SIZE_T parentNode, sep, leftNode, rightNode, offset;
+
+  //The root has no siblings to even out with
+  if (path.empty()) return ERROR_NOERROR;
+
+  parentNode = path.back();
+  path.pop_back();
+  if ((rc = parent.Unserialize(buffercache, parentNode))) return rc;
+  if (parent.info.numkeys == 0) return ERROR_INSANE;
+
+  //Pair the node with its left sibling if it has one, else its right;
+  //sep is the key between the two
+  offset = nodeops->LowerBound(parent.View(), key);
+  sep = offset > 0 ? offset-1 : 0;
+  if ((rc = parent.GetPtr(sep, leftNode)) || (rc = parent.GetPtr(sep+1, rightNode))) return rc;
+  if ((rc = left.Unserialize(buffercache, leftNode)) ||
+      (rc = right.Unserialize(buffercache, rightNode))) return rc;
+
+  bool leaves = left.info.nodetype == BTREE_LEAF_NODE;
+  bool lastPair = parent.info.nodetype == BTREE_ROOT_NODE && parent.info.numkeys == 1;
+
+  //The root always keeps two leaves, so when both are empty the
+  //tree goes back to the empty root it started as
+  if (leaves && lastPair)
+  {
+    if (left.info.numkeys == 0 && right.info.numkeys == 0)
+    {
+      if ((rc = DeallocateNode(leftNode)) || (rc = DeallocateNode(rightNode))) return rc;
+      parent.View().Clear(parent.info.format);
+      superblock.info.numkeys--;
+      superblock_dirty = true;
+      return parent.Serialize(buffercache, parentNode);
+    }
+  }
+
+  //Merge if the two together would not need splitting again on the
+  //next insert; otherwise, or if that does not fit, even them out
+  rc = ERROR_NOSPACE;
+  if (!(leaves && lastPair) && left.View().GetFill() + right.View().GetFill() < 2./3.)
+  {
+    rc = MergeNodes(parent, sep, left, right);
+    if (rc == ERROR_NOERROR)
+    {
+      if ((rc = left.Serialize(buffercache, leftNode)) ||
+          (rc = parent.Serialize(buffercache, parentNode)) ||
+          (rc = DeallocateNode(rightNode))) return rc;
+
+      //The leaf after the one merged away now comes after left
+      SIZE_T next = leaves ? left.View().GetRightSibling() : 0;
+      if (next != 0)
+      {
+        PinnedBlock p(buffercache);
+        if ((rc = p.Pin(next))) return rc;
+        BTreeNodeView(p.GetFrame()).SetLeftSibling(leftNode);
+        p.MarkDirty();
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
+      if (leaves)
+      {
+        superblock.info.numkeys--;
+        superblock_dirty = true;
       }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
+
+      //A root down to one child hands over to it
+      if (parent.info.nodetype == BTREE_ROOT_NODE && parent.info.numkeys == 0)
+      {
+        {
+          PinnedBlock p(buffercache);
+          if ((rc = p.Pin(leftNode))) return rc;
+          BTreeNodeView(p.GetFrame()).info.nodetype = BTREE_ROOT_NODE;
+          p.MarkDirty();
+        }
+        //Publish the new root only once it is on disk
+        if ((rc = buffercache->FlushBlock(leftNode))) return rc;
+        superblock.info.rootnode = leftNode;
+        superblock_dirty = true;
+        if ((rc = DeallocateNode(parentNode))) return rc;
+        return WriteSuperblock();
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
-      } else {
-	os << " ";
+
+      //The parent gave up a key, so may be underfull in turn
+      if (parent.info.nodetype != BTREE_ROOT_NODE && IsUnderfull(parent.View()))
+      {
+        return Rebalance(parentNode, path, key);
       }
+      return ERROR_NOERROR;
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
-    } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+    if (rc != ERROR_NOSPACE) return rc;
+  }
+
+  //The nodes are edited as copies, so a borrow that does not fit
+  //leaves them as they were: underfull, but still a sound tree
+  rc = BorrowEntries(parent, sep, left, right);
+  if (rc == ERROR_NOSPACE) return ERROR_NOERROR;
+  if (rc) return rc;
+
+  if ((rc = left.Serialize(buffercache, leftNode)) ||
+      (rc = right.Serialize(buffercache, rightNode))) return rc;
+  return parent.Serialize(buffercache, parentNode);
+}
+
+ERROR_T BTreeIndex::MergeNodes(BTreeNode &parent, const SIZE_T sep,
+			       BTreeNode &left, BTreeNode &right)
+{
+  BTreeNodeView l = left.View();
+  BTreeNodeView r = right.View();
+  ERROR_T rc;
+  KEY_T k;
+  VALUE_T v;
+  SIZE_T ptr;
+
+  //Work on copies, so that running out of room changes nothing
+  BTreeNode newLeft(left);
+  BTreeNodeView nl = newLeft.View();
+
+  if (l.info.nodetype == BTREE_LEAF_NODE)
+  {
+    //Everything in right goes on the end of left
+    for (SIZE_T i = 0; i < r.info.numkeys; i++)
+    {
+      if ((rc = r.GetKey(i,k)) || (rc = r.GetVal(i,v))) return rc;
+      if ((rc = nl.InsertKeyVal(nl.info.numkeys,k,v))) return rc;
     }
+    nl.SetRightSibling(r.GetRightSibling());
   }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
+  else
+  {
+    //The key between them comes down, ahead of right's pointers
+    if ((rc = parent.GetKey(sep,k)) || (rc = r.GetPtr(0,ptr))) return rc;
+    if ((rc = nl.InsertKeyPtr(nl.info.numkeys,k,ptr))) return rc;
+    for (SIZE_T i = 0; i < r.info.numkeys; i++)
+    {
+      if ((rc = r.GetKey(i,k)) || (rc = r.GetPtr(i+1,ptr))) return rc;
+      if ((rc = nl.InsertKeyPtr(nl.info.numkeys,k,ptr))) return rc;
+    }
   }
+  if ((rc = nl.Compact())) return rc;
+  //Under B-link, left now ends where right did
+  nl.CopyLinks(r);
+
+  //The parent loses the key and the pointer to right
+  if ((rc = parent.View().RemoveSlots(sep,1))) return rc;
+  left = newLeft;
   return ERROR_NOERROR;
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
-{
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
-}
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::BorrowEntries(BTreeNode &parent, const SIZE_T sep,
+				  BTreeNode &left, BTreeNode &right)
 {
-  // WRITE ME
+  BTreeNode newLeft(left), newRight(right), newParent(parent);
+  BTreeNodeView l = newLeft.View();
+  BTreeNodeView r = newRight.View();
+  bool leaf = l.info.nodetype == BTREE_LEAF_NODE;
+  bool rightward = l.GetFill() > r.GetFill();
+  ERROR_T rc;
+  KEY_T k, separator, first;
+  VALUE_T v;
+  SIZE_T ptr, moved = 0;
 
-  // Call the internal insert function with node == 0
+  if ((rc = parent.GetKey(sep,separator))) return rc;
 
-  return InsertInternalRecursive(0, key, value, 0);
-}
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-  // WRITE ME
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, (VALUE_T&)value);
-}
+  //Move entries one at a time from the fuller node to the other until
+  //they are about even.  Interior entries rotate through the parent:
+  //its key comes down and the one next to it in the donor goes up.
+  while (rightward ? l.GetFill() > r.GetFill() && l.info.numkeys > 1
+                   : r.GetFill() > l.GetFill() && r.info.numkeys > 1)
+  {
+    if (rightward)
+    {
+      SIZE_T last = l.info.numkeys-1;
+      if (leaf)
+      {
+        if ((rc = l.GetKey(last,k)) || (rc = l.GetVal(last,v))) return rc;
+        if ((rc = r.InsertKeyVal(0,k,v))) return rc;
+      }
+      else
+      {
+        SIZE_T oldfirst;
+        if ((rc = l.GetKey(last,k)) || (rc = l.GetPtr(last+1,ptr)) || (rc = r.GetPtr(0,oldfirst))) return rc;
+        if ((rc = r.InsertKeyPtr(0,separator,oldfirst))) return rc;
+        if ((rc = r.SetPtr(0,ptr))) return rc;
+        separator = k;
+      }
+      if ((rc = l.RemoveSlots(last,1))) return rc;
+    }
+    else
+    {
+      if (leaf)
+      {
+        if ((rc = r.GetKey(0,k)) || (rc = r.GetVal(0,v))) return rc;
+        if ((rc = l.InsertKeyVal(l.info.numkeys,k,v))) return rc;
+        if ((rc = r.RemoveSlots(0,1))) return rc;
+      }
+      else
+      {
+        SIZE_T second;
+        if ((rc = r.GetKey(0,k)) || (rc = r.GetPtr(0,ptr)) || (rc = r.GetPtr(1,second))) return rc;
+        if ((rc = l.InsertKeyPtr(l.info.numkeys,separator,ptr))) return rc;
+        if ((rc = r.RemoveSlots(0,1)) || (rc = r.SetPtr(0,second))) return rc;
+        separator = k;
+      }
+    }
+    moved++;
+  }
+  if (moved == 0) return ERROR_NOSPACE;
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
-{
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  //A leaf's separator is the last key left of it, or with TRUNCATE
+  //the shortest key between the two sides
+  if (leaf)
+  {
+    if ((rc = l.GetKey(l.info.numkeys-1,separator)) || (rc = r.GetKey(0,first))) return rc;
+    separator = LeafSeparator(separator, first);
+  }
+  if ((rc = newParent.View().SetKey(sep,separator))) return rc;
+  if (l.IsLinked() && (rc = l.SetHighKey(separator))) return rc;
+  if ((rc = l.Compact()) || (rc = r.Compact())) return rc;
+
+  left = newLeft;
+  right = newRight;
+  parent = newParent;
+  return ERROR_NOERROR;
 }
 
   
@@ -919,7 +2950,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,node,b,display_type,*this);
   
   if (rc) { return rc; }
 
@@ -964,6 +2995,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
+  TreeLock whole(treelock, concurrent);
   ERROR_T rc;
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
@@ -975,11 +3007,13 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::KeysInOrderRecursive(const SIZE_T &node, KEY_T testkey) const
+ERROR_T BTreeIndex::KeysInOrderRecursive(const SIZE_T &node, KEY_T &lastkey, bool &any,
+					 const KEY_T *hi, const SIZE_T depth,
+					 SIZE_T &leafdepth) const
 {
   BTreeNode b;
-  ERROR_T rc = ERROR_NOERROR;
-  KEY_T prevkey = -1;
+  ERROR_T rc;
+  KEY_T key;
   SIZE_T ptr;
   SIZE_T offset;
 
@@ -987,121 +3021,325 @@ ERROR_T BTreeIndex::KeysInOrderRecursive(const SIZE_T &node, KEY_T testkey) cons
   //Get node from pointer
   if ((rc = b.Unserialize(buffercache, node))) return rc;
 
+  // A B-link node's high key is the key to its right in its parent,
+  // or its parent's own high key if it is the last child
+  if (b.View().IsLinked())
+  {
+    if (!hi && b.View().HasHighKey()) return ERROR_INSANE;
+    if (hi)
+    {
+      if ((rc = b.View().GetHighKey(key))) return ERROR_INSANE;
+      if (CompareKeys(key, *hi) != 0) return ERROR_INSANE;
+    }
+  }
+
   if (b.info.nodetype == BTREE_LEAF_NODE)
   {
-    // Check to see that keys within leafnode are in correct order
+    // Every leaf is as far down as the first one
+    if (leafdepth == 0) leafdepth = depth;
+    if (depth != leafdepth) return ERROR_INSANE;
+
+    // Check to see that keys within leafnode are in correct order, and
+    // after those in the leaves before it
     for (offset = 0; offset<b.info.numkeys; offset++) 
     {
-      prevkey = testkey;
-      if ((rc=b.GetKey(offset, testkey))) return rc;
-      if (testkey < prevkey) {
-        return ERROR_NOORDER;
-      }
+      if ((rc=b.GetKey(offset, key))) return rc;
+      if (any && CompareKeys(key, lastkey) <= 0) return ERROR_NOORDER;
+      if (hi && CompareKeys(key, *hi) > 0) return ERROR_NOORDER;
+      lastkey = key;
+      any = true;
     }
+    return ERROR_NOERROR;
   }
-  else  // Interior or root node
-  {  
-    //Find place in key list
-    for (offset = 0; offset<b.info.numkeys; offset++)
-    { 
-      if ((rc=b.GetPtr(offset, ptr))) return rc;
-      if ((rc = KeysInOrderRecursive(ptr, testkey))) return rc;
+
+  if (b.info.nodetype != BTREE_INTERIOR_NODE && b.info.nodetype != BTREE_ROOT_NODE)
+  {
+    return ERROR_INSANE;
+  }
+
+  // An empty root is an empty tree
+  if (b.info.numkeys == 0 && b.info.nodetype == BTREE_ROOT_NODE) return ERROR_NOERROR;
+
+  // Interior or root node: the keys below each pointer come after
+  // everything to its left, and are no greater than the key to its right
+  for (offset = 0; offset<=b.info.numkeys; offset++)
+  { 
+    if ((rc=b.GetPtr(offset, ptr))) return rc;
+    if (offset<b.info.numkeys)
+    {
+      if ((rc=b.GetKey(offset, key))) return rc;
+      if (any && CompareKeys(key, lastkey) < 0) return ERROR_NOORDER;
+      if (hi && CompareKeys(key, *hi) > 0) return ERROR_NOORDER;
+      if ((rc = KeysInOrderRecursive(ptr, lastkey, any, &key, depth+1, leafdepth))) return rc;
+      lastkey = key;
+      any = true;
     }
-    if (b.info.numkeys>0) { 
-      if ((rc=b.GetPtr(b.info.numkeys, ptr))) return rc;
-      if ((rc = KeysInOrderRecursive(ptr, testkey))) return rc;
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+    else
+    {
+      if ((rc = KeysInOrderRecursive(ptr, lastkey, any, hi, depth+1, leafdepth))) return rc;
     }
   }
-  return rc;
+  return ERROR_NOERROR;
 }
 
 ERROR_T BTreeIndex::KeysInOrder(const SIZE_T &node) const
 {
-  KEY_T testkey;
+  KEY_T lastkey;
+  bool any = false;
+  SIZE_T leafdepth = 0;
+
+  return KeysInOrderRecursive(node, lastkey, any, 0, 0, leafdepth);
+}
+
+
+ERROR_T BTreeIndex::LeafLinksRecursive(const SIZE_T &node, SIZE_T &prevleaf) const
+{
+  BTreeNode b;
   ERROR_T rc;
-  rc = KeysInOrderRecursive(node, testkey);
-  if (rc) {
-    std::printf("Returned error %d\n", rc);
-  } else {
-    std::printf("Keys are in order!\n");
+  SIZE_T ptr;
+
+  if ((rc = b.Unserialize(buffercache, node))) return rc;
+
+  if (b.info.nodetype == BTREE_LEAF_NODE)
+  {
+    // Each leaf must point back at the one before it, and that one at it
+    if (b.View().GetLeftSibling() != prevleaf) return ERROR_INSANE;
+    if (prevleaf != 0)
+    {
+      BTreeNode prev;
+      if ((rc = prev.Unserialize(buffercache, prevleaf))) return rc;
+      if (prev.View().GetRightSibling() != node) return ERROR_INSANE;
+    }
+    prevleaf = node;
+    return ERROR_NOERROR;
   }
-  return rc;
+
+  for (SIZE_T offset = 0; b.info.numkeys>0 && offset<=b.info.numkeys; offset++)
+  {
+    if ((rc = b.GetPtr(offset, ptr))) return rc;
+    if ((rc = LeafLinksRecursive(ptr, prevleaf))) return rc;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::LeafLinksInOrder() const
+{
+  BTreeNode last;
+  SIZE_T prevleaf = 0;
+  ERROR_T rc;
+
+  if ((rc = LeafLinksRecursive(superblock.info.rootnode, prevleaf))) return rc;
+
+  // And the last leaf ends the chain
+  if (prevleaf != 0)
+  {
+    if ((rc = last.Unserialize(buffercache, prevleaf))) return rc;
+    if (last.View().GetRightSibling() != 0) return ERROR_INSANE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LevelLinksInOrder() const
+{
+  vector<SIZE_T> level(1, superblock.info.rootnode), below;
+  ERROR_T rc;
+  SIZE_T ptr;
+
+  // A level at a time, left to right, down to the leaves
+  while (!level.empty())
+  {
+    below.clear();
+    for (SIZE_T i = 0; i < level.size(); i++)
+    {
+      BTreeNode b;
+      if ((rc = b.Unserialize(buffercache, level[i]))) return rc;
+      if (b.info.nodetype == BTREE_LEAF_NODE) return ERROR_NOERROR;
+
+      // Each interior node leads on to the next one, and the last to none
+      if (b.View().IsLinked() &&
+	  b.View().GetRightSibling() != (i+1 < level.size() ? level[i+1] : 0)) return ERROR_INSANE;
+
+      for (SIZE_T offset = 0; b.info.numkeys>0 && offset<=b.info.numkeys; offset++)
+      {
+	if ((rc = b.GetPtr(offset, ptr))) return rc;
+	below.push_back(ptr);
+      }
+    }
+    level.swap(below);
+  }
+  return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::SanityCheck() const
 {
+  TreeLock whole(treelock, concurrent);
   ERROR_T rc;
 
-  // Possible things to test
-  // are the keys of the tree in order??
+  // Are the keys of the tree in order, and all the leaves as deep?
   if((rc = KeysInOrder(superblock.info.rootnode))) {return rc;}
 
-  // Check if tree is at least half full
-  if((rc = AtLeastHalfFullWrapper((SIZE_T)1))) return rc;
+  // Do the leaf links agree with the tree?
+  if((rc = LeafLinksInOrder())) return rc;
 
-  return ERROR_UNIMPL;
+  // And, in a B-link index, the links between interior nodes?
+  if((rc = LevelLinksInOrder())) return rc;
+
+  return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::AtLeastHalfFullWrapper(const SIZE_T &node) const{
-	std::printf("Start node:%d\n",node);
-	ERROR_T rc = ERROR_NOERROR;
-	float percentFull = AtLeastHalfFull(node);
-	if(percentFull<.5){
-		rc = ERROR_SIZE;
-		std::printf("%f\n",percentFull);
-	}
-	return rc;
+
+ostream & BTreeIndex::Print(ostream &os) const
+{
+  Display(os, BTREE_SORTED_KEYVAL);
+  return os;
 }
-float BTreeIndex::AtLeastHalfFull(const SIZE_T &node) const{
-  BTreeNode b;
-  ERROR_T rc = ERROR_NOERROR;
-  //KEY_T testkey;
-  KEY_T prevkey = -1;
-  SIZE_T ptr;
-  SIZE_T offset;
 
 
-  //Get node from pointer
-  if ((rc = b.Unserialize(buffercache, node))) return rc;
+BTreeCursor::BTreeCursor(const BTreeIndex &i) : index(&i), leaf(0), offset(0)
+{}
 
-  if (b.info.nodetype == BTREE_LEAF_NODE)
+
+ERROR_T BTreeCursor::Descend(const KEY_T *key, const bool last)
+{
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+  SIZE_T node = index->superblock.info.rootnode;
+
+  leaf = 0;
+  if ((rc = p.Pin(node))) return rc;
+
+  while (BTreeNodeView(p.GetFrame()).info.nodetype != BTREE_LEAF_NODE)
   {
-    // count how many keys
-  	return b.info.numkeys/(float)b.info.GetNumSlotsAsLeaf();
+    BTreeNodeView b(p.GetFrame());
+
+    //An empty root means an empty index
+    if (b.info.numkeys == 0) return ERROR_NONEXISTENT;
+    if ((rc = b.GetPtr(key ? index->nodeops->LowerBound(b,*key) : last ? b.info.numkeys : 0, node))) return rc;
+    if ((rc = p.Pin(node))) return rc;
   }
-  else  // Interior or root node
-  {  
-	float percentFull=0;
-    //Find next node
-    for (offset = 0; offset<b.info.numkeys; offset++)
-    { 
-	  
-      if ((rc=b.GetPtr(offset, ptr))) return rc;
-      percentFull += AtLeastHalfFull(ptr);
-    }
-    if (b.info.numkeys>0) { 
-      if ((rc=b.GetPtr(b.info.numkeys, ptr))) return rc;
-      percentFull += AtLeastHalfFull(ptr);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-   		
-		std::printf("Didn't want to get here...\n"); 
-		std::printf("Node number: %d\nNode Type: %d\nNumKeys: %d\n",node,b.info.nodetype,b.info.numkeys);
-		percentFull = 0.5; //Doing this won't affect whether our average is off
-	}
-	return percentFull/(b.info.numkeys+1);
+  leaf = node;
+
+  BTreeNodeView b(p.GetFrame());
+  if (key)
+  {
+    offset = index->nodeops->LowerBound(b,*key);
+    return offset < b.info.numkeys ? ERROR_NOERROR : StepRight();
+  }
+  if (b.info.numkeys == 0)
+  {
+    return last ? StepLeft() : StepRight();
   }
+  offset = last ? b.info.numkeys-1 : 0;
+  return ERROR_NOERROR;
 }
 
 
-ostream & BTreeIndex::Print(ostream &os) const
+ERROR_T BTreeCursor::StepRight()
 {
-  Display(os, BTREE_SORTED_KEYVAL);
-  return os;
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+
+  //Empty leaves are passed over
+  do
+  {
+    if ((rc = p.Pin(leaf))) return rc;
+    leaf = BTreeNodeView(p.GetFrame()).GetRightSibling();
+    if (leaf == 0) return ERROR_NONEXISTENT;
+    if ((rc = p.Pin(leaf))) return rc;
+  } while (BTreeNodeView(p.GetFrame()).info.numkeys == 0);
+
+  offset = 0;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCursor::StepLeft()
+{
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+
+  do
+  {
+    if ((rc = p.Pin(leaf))) return rc;
+    leaf = BTreeNodeView(p.GetFrame()).GetLeftSibling();
+    if (leaf == 0) return ERROR_NONEXISTENT;
+    if ((rc = p.Pin(leaf))) return rc;
+  } while (BTreeNodeView(p.GetFrame()).info.numkeys == 0);
+
+  offset = BTreeNodeView(p.GetFrame()).info.numkeys-1;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCursor::Seek(const KEY_T &key)
+{
+  return Descend(&key, false);
+}
+
+
+ERROR_T BTreeCursor::SeekFirst()
+{
+  return Descend(0, false);
+}
+
+
+ERROR_T BTreeCursor::SeekLast()
+{
+  return Descend(0, true);
+}
+
+
+ERROR_T BTreeCursor::Next()
+{
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+
+  if (!Valid()) return ERROR_NONEXISTENT;
+  if ((rc = p.Pin(leaf))) return rc;
+  if (++offset < BTreeNodeView(p.GetFrame()).info.numkeys) return ERROR_NOERROR;
+  return StepRight();
+}
+
+
+ERROR_T BTreeCursor::Prev()
+{
+  if (!Valid()) return ERROR_NONEXISTENT;
+  if (offset > 0)
+  {
+    offset--;
+    return ERROR_NOERROR;
+  }
+  return StepLeft();
+}
+
+
+bool BTreeCursor::Valid() const
+{
+  return leaf != 0;
+}
+
+
+ERROR_T BTreeCursor::Key(KEY_T &key) const
+{
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+
+  if (!Valid()) return ERROR_NONEXISTENT;
+  if ((rc = p.Pin(leaf))) return rc;
+  return BTreeNodeView(p.GetFrame()).GetKey(offset, key);
+}
+
+
+ERROR_T BTreeCursor::Value(VALUE_T &value) const
+{
+  PinnedBlock p(index->buffercache);
+  ERROR_T rc;
+
+  if (!Valid()) return ERROR_NONEXISTENT;
+  if ((rc = p.Pin(leaf))) return rc;
+  return BTreeNodeView(p.GetFrame()).GetVal(offset, value);
 }
 
 
@@ -11,6 +11,9 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "btree_layout.h"
+#include "btree_nodecache.h"
+#include "btree_latch.h"
 
 using namespace std;
 
@@ -42,31 +45,213 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// When Insert splits a node (see SetSplitPolicy)
+enum BTreeSplitPolicy {BTREE_SPLIT_EAGER, BTREE_SPLIT_FULL, BTREE_SPLIT_BSTAR};
+
+// Under BTREE_SPLIT_BSTAR a full node shares its entries with a
+// sibling if the two would then be no fuller than this on average
+#define BTREE_BSTAR_SHARE_FILL 0.9
+
+// How much of a node split at the right edge of the tree stays on
+// the left, under append splitting
+#define BTREE_APPEND_SPLIT_FILL 0.9
+
+// How many free list entries AllocateNode will look at when trying to
+// place a node close to a hint before settling for the best seen so
+// far; past the first it looks only at those already in the cache
+#define BTREE_ALLOC_SEARCH_DEPTH 8
+
+// How many leaves Scan prefetches ahead of the one it is on (at most
+// a quarter of the buffer cache)
+#define BTREE_SCAN_READAHEAD 8
+
+// Scan calls this for each pair in order; returning nonzero stops
+// the scan, which then returns the same
+typedef ERROR_T (*BTreeScanFn)(const KEY_T &key, const VALUE_T &value, void *arg);
+
+// BulkLoad calls this for each pair to load, in key order; it
+// returns ERROR_NONEXISTENT once there are no more
+typedef ERROR_T (*BTreeLoadFn)(KEY_T &key, VALUE_T &value, void *arg);
+
+// A node that a delete leaves less full than this borrows from or
+// merges with a sibling, unless told otherwise
+#define BTREE_UNDERFLOW_FILL (1./3.)
+
+// How full BulkLoad makes each node unless told otherwise
+#define BTREE_BULKLOAD_FILL 0.9
+
 class BTreeIndex {
+  friend class BTreeCursor;
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  // The superblock lives in memory; this says whether it differs
+  // from the copy on disk
+  bool         superblock_dirty;
+  // Node search specialized for this index's key and value sizes,
+  // chosen at Attach
+  const BTreeNodeOps *nodeops;
+  // Delete's underflow threshold; see SetUnderflowFill
+  double       underflow;
+  // See SetSplitPolicy
+  BTreeSplitPolicy splitpolicy;
+  bool         appendsplit;
+  // See SetTopDownInsert
+  bool         topdown;
+  // Decoded copies of interior nodes; see SetNodeCacheSize
+  BTreeNodeCache nodecache;
+  // See SetConcurrent.  Inserts, updates and lookups latch nodes and
+  // share the tree lock; everything else holds the tree lock itself.
+  bool         concurrent;
+  bool         optimistic;
+  NodeLatchTable latches;
+  mutable TreeGate treelock;
+  // The in-memory superblock's counts, free list and dirty flag, which
+  // writers in different parts of the tree all change.  The root
+  // pointer is changed only under the superblock's latch.
+  mutex        superblock_lock;
 
  protected:
 
-  ERROR_T      AllocateNode(SIZE_T &node);
+  ERROR_T      WriteSuperblock();
+
+  // If near is nonzero, prefer a free block on the same cylinder
+  // as (or otherwise closest to) block near
+  ERROR_T      AllocateNode(SIZE_T &node, const SIZE_T near=0);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
+  // Writes an empty node of this type and format to block node
+  ERROR_T      InitNode(const SIZE_T node, const int nodetype, const SIZE_T format);
+
+  // The format new nodes of this type are created in, from the
+  // index options
+  SIZE_T       GetNodeFormat(const int nodetype) const;
+
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op,
 				      const KEY_T &key,
 				      VALUE_T &val);
-
+  // What Insert and Update do with the tree to themselves
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value);
+  ERROR_T      UpdateInternal(const KEY_T &key, const VALUE_T &value);
+
+  // Concurrent mode (see SetConcurrent).  Down to the leaf for key with
+  // shared latches, letting go of each node once the next is latched.
+  // The leaf is left pinned in p and latched in held, exclusively if
+  // asked for.  ERROR_NONEXISTENT if the tree is empty.
+  ERROR_T      DescendLatched(const KEY_T &key, const bool exclusive, LatchSet &held,
+			      PinnedBlock &p, SIZE_T &leaf);
+  // The same, with optimistic lock coupling: interior nodes are
+  // checked against their versions rather than latched
+  ERROR_T      DescendOptimistic(const KEY_T &key, const bool exclusive, LatchSet &held,
+				 PinnedBlock &p, SIZE_T &leaf);
+  ERROR_T      LookupOrUpdateLatched(const BTreeOp op, const KEY_T &key, VALUE_T &val);
+  // Sets exclusive, having changed nothing, for the inserts that have
+  // to be done with the tree to themselves
+  ERROR_T      InsertLatched(const KEY_T &key, const VALUE_T &value, bool &exclusive);
+  // What InsertLatched does when the leaf is full, with optimistic
+  // lock coupling
+  ERROR_T      InsertOptimistic(const KEY_T &key, const VALUE_T &value, bool &exclusive);
+  // B-link indexes (BTREE_OPT_BLINK): down to the leaf for key holding
+  // one latch at a time, moving right past any node whose high key is
+  // below key.  path, if given, gets the node the descent left each
+  // level by, root first.
+  ERROR_T      DescendBlink(const KEY_T &key, const bool exclusive, LatchSet &held,
+			    PinnedBlock &p, SIZE_T &leaf, vector<SIZE_T> *path=0);
+  // Splits bottom-up, latching only the node it changes (and a new
+  // sibling), and adds each splitting key to the parent after letting
+  // go of the node below
+  ERROR_T      InsertBlink(const KEY_T &key, const VALUE_T &value, bool &exclusive);
+  // Adds to path the nodes down the left edge of the tree from root
+  // that are at least height levels above the leaves, root first
+  ERROR_T      LeftEdgePath(SIZE_T root, const SIZE_T height, vector<SIZE_T> &path);
+
+  // Whether an insert that left node like this should split it now
+  bool         NeedsSplit(const BTreeNodeView &b) const;
+  // Whether a top-down insert should split node before going into it
+  bool         IsFull(const BTreeNodeView &b) const;
+
+  // Makes room in node (whose ancestors are path, root first) for key
+  // as the split policy says: by splitting it, or by sharing with a
+  // sibling.  Says in level which nodes hold what node held.
+  ERROR_T      MakeRoom(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key,
+			vector<SIZE_T> &level);
+  // Under append splitting, whether key goes at the end of node and
+  // node is at the right edge of the tree
+  ERROR_T      AtRightEdge(SIZE_T node, const vector<SIZE_T> &path, const KEY_T &key,
+			   bool &edge);
+  // BTREE_SPLIT_BSTAR: evens node out with a sibling or, if both are
+  // full, splits two leaves into three.  ERROR_NOSPACE if neither
+  // happened, and node needs splitting as usual.
+  ERROR_T      ShareOrSplitThree(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key,
+				 vector<SIZE_T> &level);
+  ERROR_T      SplitThree(vector<SIZE_T> &path, BTreeNode &parent, const SIZE_T sep,
+			  const SIZE_T leftNode, BTreeNode &left,
+			  const SIZE_T rightNode, BTreeNode &right,
+			  vector<SIZE_T> &level);
+  // The key to put between two leaves, given the last key of the left
+  // one and the first of the right one
+  KEY_T        LeafSeparator(const KEY_T &left, const KEY_T &right) const;
+
+  // path holds the nodes above node, root first; splits use it up
+  // on their way back up
   ERROR_T      InsertInternalRecursive(SIZE_T node,
+              vector<SIZE_T> &path,
               KEY_T key,
               VALUE_T value,
               SIZE_T newNode);
 
+  // Insert in one pass from the root down (see SetTopDownInsert)
+  ERROR_T      InsertTopDown(const KEY_T &key, const VALUE_T &value);
+
   ERROR_T      makeTree(BTreeNode referenceNode, KEY_T key, VALUE_T value);
 
-  SIZE_T       FindLeaf(KEY_T key);
+  // The leaf for key, and in path the nodes above it, root first
+  SIZE_T       FindLeaf(const KEY_T &key, vector<SIZE_T> &path);
+
+  // After a split, down from the root to whichever of the nodes of
+  // level (a node and the ones it was split or shared into) holds key
+  // now, and the path to it
+  ERROR_T      DescendTo(const KEY_T &key, const vector<SIZE_T> &level,
+			 SIZE_T &node, vector<SIZE_T> &path);
+
+  // Like FindLeaf, and the largest key that leaf can hold as far as
+  // its ancestors are concerned (bounded is false if any key can go
+  // there).  Goes through decoded interior nodes (see SetNodeCacheSize)
+  // where it can.  The second form leaves the leaf pinned in p.
+  ERROR_T      FindLeafBound(const KEY_T &key, SIZE_T &leaf, vector<SIZE_T> &path,
+			     KEY_T &bound, bool &bounded);
+  ERROR_T      FindLeafBound(const KEY_T &key, SIZE_T &leaf, vector<SIZE_T> &path,
+			     KEY_T &bound, bool &bounded, PinnedBlock &p);
+
+  // InsertBatch and UpdateBatch: op is BTREE_OP_INSERT or BTREE_OP_UPDATE
+  ERROR_T      ApplyBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results,
+			  const BTreeOp op);
+
+  // After a delete leaves node (whose ancestors are path, root first)
+  // underfull, merges it with or borrows from a sibling, and so on up
+  // the tree for each parent that is left underfull in turn.  key is
+  // the deleted key, which picks out node among its parent's children.
+  ERROR_T      Rebalance(SIZE_T node, vector<SIZE_T> &path, const KEY_T &key);
+  // Both return ERROR_NOSPACE, changing nothing, if the entries do not fit
+  ERROR_T      MergeNodes(BTreeNode &parent, const SIZE_T sep,
+			  BTreeNode &left, BTreeNode &right);
+  ERROR_T      BorrowEntries(BTreeNode &parent, const SIZE_T sep,
+			     BTreeNode &left, BTreeNode &right);
+  bool         IsUnderfull(const BTreeNodeView &b) const;
+
+  // BulkLoad's leaves, left to right, and the keys between them
+  ERROR_T      LoadLeaves(BTreeLoadFn fn, void *arg, const double fill,
+			  vector<SIZE_T> &nodes, vector<KEY_T> &seps,
+			  vector<SIZE_T> &built, SIZE_T &numkeys);
+  // Replaces one level of nodes and the keys between them with the
+  // level of interior nodes above
+  ERROR_T      BuildLevel(vector<SIZE_T> &nodes, vector<KEY_T> &seps, const double fill,
+			  vector<SIZE_T> &built, SIZE_T &numkeys);
+  // B-link: chains one level of nodes together through their right
+  // links and high keys
+  ERROR_T      LinkLevel(const vector<SIZE_T> &nodes, const vector<KEY_T> &seps);
 
   ERROR_T      InsertKeyValue(
               SIZE_T node,
@@ -75,9 +260,23 @@ class BTreeIndex {
               SIZE_T newNode,
               bool rhs);
 
-  KEY_T        SplitNode(SIZE_T node, SIZE_T newNode);
+  // fraction is how much of node stays on the left
+  KEY_T        SplitNode(SIZE_T node, SIZE_T newNode, const double fraction=0.5);
+
+  // Splits node into itself and a new sibling and adds the splitting
+  // key to its parent, the last node on path (the nodes above node,
+  // root first), growing a new root if node is the root.  path is
+  // used up and no longer says where node is.
+  ERROR_T      SplitAndPromote(SIZE_T node, vector<SIZE_T> &path, SIZE_T &newNode,
+			       KEY_T &splittingKey, const double fraction=0.5);
+  // Puts a new root above root node, just split into itself and
+  // newNode at splittingKey, and publishes it
+  ERROR_T      GrowRoot(SIZE_T node, const KEY_T &splittingKey, SIZE_T newNode);
 
-  SIZE_T       FindParent(SIZE_T node);
+  // Prefetches the leaves after the one for key, up to
+  // BTREE_SCAN_READAHEAD of them and none wholly past hi, from that
+  // leaf's parent, and says which they are
+  ERROR_T      ReadAhead(const KEY_T &key, const KEY_T &hi, vector<SIZE_T> &ahead);
 
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
@@ -92,11 +291,12 @@ public:
   // and actually write the data in the superblock.
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
-  // invoked
+  // invoked.  Likewise options (BTREE_OPT_*) only matter on creation.
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,   // true if a  key maps to a single value
+	     SIZE_T options=0);
 
 
   BTreeIndex();
@@ -119,6 +319,10 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Force every changed block, and then the in-memory superblock, out
+  // to disk without detaching
+  ERROR_T Checkpoint();
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
@@ -135,24 +339,127 @@ public:
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Delete(const KEY_T &key);
+
+  // A delete that leaves a node less full than fill (a fraction of the
+  // node) evens it out with a sibling, or merges the two if together
+  // they are short of the fill at which inserts split.  Fill 0 is the
+  // lazy mode, in which only nodes left empty are merged away, so
+  // that keys churning in and out do not split and merge the same
+  // nodes over and over.  BTREE_OPT_LAZYDELETE indexes start out in
+  // lazy mode and the rest at BTREE_UNDERFLOW_FILL.
+  void    SetUnderflowFill(const double fill);
+
+  // BTREE_SPLIT_EAGER splits a node into halves once an insert leaves
+  // it 2/3 full, so nodes stay from 1/3 to 2/3 full.  BTREE_SPLIT_FULL
+  // waits until an entry does not fit.  BTREE_SPLIT_BSTAR also waits,
+  // then first evens the node out with a sibling that has room, and
+  // if neither sibling has, splits a pair of full leaves into three
+  // about 2/3 full each.  With append, a node split by an insert at
+  // the right edge of the tree keeps BTREE_APPEND_SPLIT_FILL of its
+  // entries instead of half, so ascending inserts leave full nodes
+  // behind.  BTREE_OPT_SPLITFULL, BTREE_OPT_BSTAR and
+  // BTREE_OPT_APPENDSPLIT pick these when an index is attached.
+  void    SetSplitPolicy(const BTreeSplitPolicy policy, const bool append=false);
+
+  // Top-down inserts split every full node they meet on the way down,
+  // while its parent is in hand.  The parent then always has room for
+  // the splitting key, so nothing is split on the way back up and an
+  // insert is a single pass from the root to a leaf.  A node is full
+  // if the split policy would split it after an insert, and otherwise
+  // (BTREE_SPLIT_FULL and BTREE_SPLIT_BSTAR) if an entry of the
+  // largest size may not fit.  Such splits are always in two, so
+  // BTREE_SPLIT_BSTAR does not share with siblings.  Updates, batches
+  // and the rare entry that still does not fit (a prefix-compressed
+  // node that has to shorten its prefix for it) split bottom-up as
+  // before.  BTREE_OPT_TOPDOWN picks this when an index is attached.
+  void    SetTopDownInsert(const bool on);
+
+  // Lookups, updates and the searches before inserts and deletes go
+  // down through copies of up to this many interior nodes, decoded and
+  // kept in memory, at the cost of key compares only.  The top levels
+  // are kept first.  A copy is dropped as soon as its block is written,
+  // so it is never out of date.  BTREE_NODECACHE_SIZE nodes to start
+  // with; 0 turns this off.
+  void    SetNodeCacheSize(const SIZE_T nodes);
+
+  // Lets several threads call Insert, Update and Lookup on this index
+  // at once, on a buffer cache they all share; every other call waits
+  // for the index to itself.  Nodes are latched on the way down and let
+  // go once nothing below them can split.  With optimistic set only
+  // leaves are latched: interior nodes are read, from their decoded
+  // copies or their blocks, and checked against their versions, and a
+  // descent that finds one has changed starts again from the root; in
+  // a BTREE_OPT_BLINK index it moves right past the split instead.
+  // btree_stress exercises this.
+  void    SetConcurrent(const bool on, const bool optimistic=false);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Inserts or updates every pair in pairs, with results[i] what
+  // Insert or Update would have returned for pairs[i] had the pairs
+  // been applied one at a time in order.  The pairs are sorted and
+  // grouped by leaf, so each leaf is found once and changed in place
+  // with all of its pairs; when one fills up it is split and the rest
+  // of its pairs go on to whichever half they belong in.  Returns
+  // nonzero only if something other than a single pair failed.
+  ERROR_T InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+  ERROR_T UpdateBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+
+  // Looks up every key in keys at once: values[i] and results[i] are
+  // what Lookup(keys[i],...) would give.  The keys are sorted and the
+  // tree descended once, a level at a time, so each node on the way
+  // is read once and the nodes of a level are prefetched together.
+  // Returns nonzero only if something other than a lookup failed.
+  ERROR_T MultiGet(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+		   vector<ERROR_T> &results);
+
+  // Builds an empty index bottom up from the pairs fn hands over,
+  // which must come in ascending key order.  Leaves are filled to
+  // fill (the fraction of each node used) and written left to right
+  // into consecutive free blocks, then each level of interior nodes
+  // above them the same way.  Returns ERROR_CONFLICT if the index is
+  // not empty and ERROR_NOORDER if a key is not greater than the one
+  // before it; on any error the index is left empty.
+  ERROR_T BulkLoad(BTreeLoadFn fn, void *arg, const double fill=BTREE_BULKLOAD_FILL);
+
+  // Calls fn, in key order, with every pair whose key is from lo to
+  // hi inclusive, stopping after limit of them (0 for no limit).
+  // Descends once, then follows the leaf links, reading leaves ahead.
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, const SIZE_T limit,
+	       BTreeScanFn fn, void *arg);
+
+  // Turns a key as typed (on a sim line or a tool's command line)
+  // into the key to use: the text itself or, in an integer key index,
+  // the number it spells, encoded.  ERROR_SIZE if that is not a number.
+  ERROR_T ParseKey(const char *text, KEY_T &key) const;
+  // And back again, for display
+  ostream & PrintKey(ostream &os, const KEY_T &key) const;
+
 
   // HELPER FUNCTIONS FOR SANITY CHECK
 
-  // Check whether the keys in the leaves are in order
-  ERROR_T KeysInOrderRecursive(const SIZE_T &node, KEY_T testkey) const;
+  // Check that the keys below node are in order, each one after
+  // lastkey (if any) and no greater than hi (if given), and that every
+  // leaf is depth levels down from node, as deep as every other leaf
+  // (leafdepth, 0 until the first leaf is seen)
+  ERROR_T KeysInOrderRecursive(const SIZE_T &node, KEY_T &lastkey, bool &any,
+			       const KEY_T *hi, const SIZE_T depth,
+			       SIZE_T &leafdepth) const;
   ERROR_T KeysInOrder(const SIZE_T &node) const;
 
-  //Check if tree is at least half full
-  ERROR_T AtLeastHalfFullWrapper(const SIZE_T &node) const;
-  float AtLeastHalfFull(const SIZE_T &node) const;
+  // Check that the leaf sibling links visit the leaves in key order
+  ERROR_T LeafLinksRecursive(const SIZE_T &node, SIZE_T &prevleaf) const;
+  ERROR_T LeafLinksInOrder() const;
+
+  // Check that each level of interior nodes of a B-link index is
+  // chained left to right through their right links
+  ERROR_T LevelLinksInOrder() const;
+
   // Here you should figure out if your index makes sense
-  // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
-  // a valid use ratio?
+  // Is it a tree?  Is it in order?  Is it balanced?  Do the leaf links
+  // (and any high keys and right links) agree with it?
   ERROR_T SanityCheck() const;
 
   // Display tree
@@ -174,4 +481,46 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+//
+// A position among the key/value pairs of an index, in key order.
+// Seeking descends from the root once; Next and Prev then follow the
+// leaf sibling links, so walking the whole index reads each leaf once.
+// A cursor holds no pins between calls, and is good only until the
+// index is next changed.
+//
+class BTreeCursor {
+  friend class BTreeIndex;
+ private:
+  const BTreeIndex *index;
+  SIZE_T leaf;     // 0 when not on a pair
+  SIZE_T offset;
+
+  // Down to the leaf for key, or the first or last leaf if key is 0
+  ERROR_T Descend(const KEY_T *key, const bool last);
+  // To the first pair of the next nonempty leaf right of this one,
+  // or the last of the next nonempty leaf to its left
+  ERROR_T StepRight();
+  ERROR_T StepLeft();
+
+ public:
+  BTreeCursor(const BTreeIndex &index);
+
+  // Each of these returns zero with the cursor on a pair, or
+  // ERROR_NONEXISTENT with it on none, when it runs off either end
+  ERROR_T Seek(const KEY_T &key);   // The first pair whose key is >= key
+  ERROR_T SeekFirst();
+  ERROR_T SeekLast();
+  ERROR_T Next();
+  ERROR_T Prev();
+
+  bool    Valid() const;
+  ERROR_T Key(KEY_T &key) const;
+  ERROR_T Value(VALUE_T &value) const;
+};
+
+// The BTREE_OPT_* bit for an option name as written on an INIT line
+// or btree_init's command line, e.g. "PREFIX"; 0 if there is none
+SIZE_T GetIndexOption(const string &name);
+
 #endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fill] < pairs\n";
+  cerr << "       pairs is \"key value\" lines in ascending key order\n";
+}
+
+
+// Hands BulkLoad the next "key value" pair from standard input
+static ERROR_T ReadPair(KEY_T &key, VALUE_T &value, void *arg)
+{
+  string k, v;
+  ERROR_T rc;
+
+  if (!(cin >> k >> v)) { 
+    return ERROR_NONEXISTENT;
+  }
+  if ((rc=((BTreeIndex *)arg)->ParseKey(k.c_str(),key))) { 
+    return rc;
+  }
+  value=VALUE_T(v.c_str());
+  return ERROR_NOERROR;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fill=BTREE_BULKLOAD_FILL;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc==4) { 
+    fill=atof(argv[3]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.BulkLoad(ReadPair,&btree,fill))!=ERROR_NOERROR) { 
+      cerr <<"Bulk load failed: error "<<rc<<endl;
+    } else {
+      cerr <<"Bulk load succeeded\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
@@ -28,6 +28,7 @@ int main(int argc, char **argv)
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
+  KEY_T k;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) { 
@@ -40,7 +41,7 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Delete(KEY_T(key)))!=ERROR_NOERROR) { 
+    if ((rc=btree.ParseKey(key,k)) || (rc=btree.Delete(k))!=ERROR_NOERROR) { 
       cerr <<"Can't delete from index due to error "<<rc<<endl;
     } else {
       cerr <<"Delete succeeded\n";
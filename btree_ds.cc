@@ -7,16 +7,23 @@
 #include "buffercache.h"
 
 #include "btree.h"
+#include "keysearch.h"
 
 using namespace std;
 
-SIZE_T NodeMetadata::GetNumDataBytes() const
+SIZE_T NodeMetadata::GetNumPayloadBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
   return n;
 }
 
 
+SIZE_T NodeMetadata::GetNumDataBytes() const
+{
+  return GetNumPayloadBytes()-highkeyroom;
+}
+
+
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
   return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
@@ -36,13 +43,20 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
 				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<", format="<<format
+     << ", leftsibling="<<leftsibling<<", rightsibling="<<rightsibling
+     << ", highkeyroom="<<highkeyroom<<", highkey="<<highkey<<")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.format=BTREE_FORMAT_CLASSIC;
+  info.leftsibling=0;
+  info.rightsibling=0;
+  info.highkeyroom=0;
+  info.highkey=0;
   data=0;
 }
 
@@ -65,10 +79,15 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.format=BTREE_FORMAT_CLASSIC;
+  info.leftsibling=0;
+  info.rightsibling=0;
+  info.highkeyroom=0;
+  info.highkey=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memset(data,0,info.GetNumDataBytes());
+    data = new char [info.GetNumPayloadBytes()];
+    memset(data,0,info.GetNumPayloadBytes());
   }
 }
 
@@ -81,10 +100,15 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
+  info.format=rhs.info.format;
+  info.leftsibling=rhs.info.leftsibling;
+  info.rightsibling=rhs.info.rightsibling;
+  info.highkeyroom=rhs.info.highkeyroom;
+  info.highkey=rhs.info.highkey;
   data=0;
   if (rhs.data) { 
-   data=new char [info.GetNumDataBytes()];
-    memcpy(data,rhs.data,info.GetNumDataBytes());
+   data=new char [info.GetNumPayloadBytes()];
+    memcpy(data,rhs.data,info.GetNumPayloadBytes());
   }
 }
 
@@ -99,11 +123,11 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  Block block(sizeof(info)+info.GetNumPayloadBytes());
 
   memcpy(block.data,&info,sizeof(info));
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+    memcpy(block.data+sizeof(info),data,info.GetNumPayloadBytes());
   }
 
   return b->WriteBlock(blocknum,block);
@@ -132,25 +156,210 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    data = new char [info.GetNumPayloadBytes()];
+    memcpy(data,block.data+sizeof(info),info.GetNumPayloadBytes());
   }
   
   return ERROR_NOERROR;
 }
 
 
-char * BTreeNode::ResolveKey(const SIZE_T offset) const
+BTreeNodeView::BTreeNodeView(NodeMetadata &i, char *d) : 
+  info(i), data(d)
+{}
+
+
+BTreeNodeView::BTreeNodeView(Block &frame) : 
+  info(*(NodeMetadata *)(frame.data)), data((char *)(frame.data)+sizeof(NodeMetadata))
+{}
+
+
+//
+// Where the first pointer is.  In the fixed-size formats everything
+// after it is laid out the same way, just with shorter keys when
+// compressed; in a slotted node the offsets follow it, and in a split
+// node the other pointers
+//
+static char *ResolveFirstPtr(const BTreeNodeView &b)
+{
+  switch (b.info.format) { 
+  case BTREE_FORMAT_PREFIX:
+    return b.data+sizeof(SIZE_T)+b.GetPrefixLength();
+  case BTREE_FORMAT_SLOTTED:
+    return b.data+2*sizeof(SIZE_T);
+  case BTREE_FORMAT_SOA:
+    return b.data+b.info.GetNumSlotsAsInterior()*b.info.keysize;
+  default:
+    return b.data;
+  }
+}
+
+
+//
+// Slotted nodes: the HEAP and FREE header fields, the offsets, and
+// the records they point to
+//
+#define SLOTTED_HEADER (3*sizeof(SIZE_T))
+
+static SIZE_T GetField(const char *p)
+{
+  SIZE_T x;
+  memcpy(&x,p,sizeof(SIZE_T));
+  return x;
+}
+
+static void SetField(char *p, const SIZE_T x)
+{
+  memcpy(p,&x,sizeof(SIZE_T));
+}
+
+static char *ResolveRecord(const BTreeNodeView &b, const SIZE_T offset)
+{
+  return b.data+GetField(b.data+SLOTTED_HEADER+offset*sizeof(SIZE_T));
+}
+
+static SIZE_T GetRecordSize(const BTreeNodeView &b, const SIZE_T offset)
+{
+  const char *r=ResolveRecord(b,offset);
+  SIZE_T keylen=GetField(r);
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    return 2*sizeof(SIZE_T)+keylen+GetField(r+sizeof(SIZE_T)+keylen);
+  }
+  return 2*sizeof(SIZE_T)+keylen;
+}
+
+// Packs the records back up against the end of the block
+static void Defragment(BTreeNodeView &b)
+{
+  SIZE_T numbytes=b.info.GetNumDataBytes();
+  SIZE_T heap=numbytes;
+  char *old=new char [numbytes];
+
+  memcpy(old,b.data,numbytes);
+  BTreeNodeView oldview(b.info,old);
+
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    SIZE_T size=GetRecordSize(oldview,i);
+    heap-=size;
+    memcpy(b.data+heap,ResolveRecord(oldview,i),size);
+    SetField(b.data+SLOTTED_HEADER+i*sizeof(SIZE_T),heap);
+  }
+  SetField(b.data,heap);
+
+  delete [] old;
+}
+
+// Adds entry offset with reclen bytes of record space, which it
+// returns, or returns 0 if the node does not have that much room
+static char *AllocateRecord(BTreeNodeView &b, const SIZE_T offset, const SIZE_T reclen)
+{
+  SIZE_T heap=GetField(b.data);
+  SIZE_T free=GetField(b.data+sizeof(SIZE_T));
+  char *offsets=b.data+SLOTTED_HEADER;
+
+  if (offset>b.info.numkeys || free<reclen+sizeof(SIZE_T)) { 
+    return 0;
+  }
+  if (heap<SLOTTED_HEADER+(b.info.numkeys+1)*sizeof(SIZE_T)+reclen) { 
+    Defragment(b);
+    heap=GetField(b.data);
+  }
+  heap-=reclen;
+
+  memmove(offsets+(offset+1)*sizeof(SIZE_T),offsets+offset*sizeof(SIZE_T),
+	  (b.info.numkeys-offset)*sizeof(SIZE_T));
+  SetField(offsets+offset*sizeof(SIZE_T),heap);
+  SetField(b.data,heap);
+  SetField(b.data+sizeof(SIZE_T),free-reclen-sizeof(SIZE_T));
+  b.info.numkeys++;
+
+  return b.data+heap;
+}
+
+// Writes the record of entry offset, as a new entry or in place of the
+// one there, from the key and then either the value (leaf) or the
+// pointer to its right (interior).  A leaf key or value longer than
+// the index allows is refused; interior keys are only ever compared
+// on their first keysize bytes, so are cut to that.
+static ERROR_T PutRecord(BTreeNodeView &b, const SIZE_T offset, const bool replace,
+			 const KEY_T &k, const VALUE_T &v, const SIZE_T ptr)
+{
+  bool leaf = b.info.nodetype==BTREE_LEAF_NODE;
+  SIZE_T keylen = k.length<b.info.keysize ? k.length : b.info.keysize;
+  SIZE_T size = 2*sizeof(SIZE_T)+keylen+(leaf ? v.length : 0);
+  ERROR_T rc;
+
+  if (leaf && (k.length>b.info.keysize || v.length>b.info.valuesize)) { 
+    return ERROR_SIZE;
+  }
+  if (offset>b.info.numkeys || (replace && offset==b.info.numkeys)) { 
+    return ERROR_SIZE;
+  }
+  if (replace) { 
+    if (GetField(b.data+sizeof(SIZE_T))+GetRecordSize(b,offset) < size) { 
+      return ERROR_NOSPACE;
+    }
+    if ((rc=b.RemoveSlots(offset,1))) { 
+      return rc;
+    }
+  }
+
+  char *r=AllocateRecord(b,offset,size);
+
+  if (r==0) { 
+    return ERROR_NOSPACE;
+  }
+  SetField(r,keylen);
+  memcpy(r+sizeof(SIZE_T),k.data,keylen);
+  r+=sizeof(SIZE_T)+keylen;
+  if (leaf) { 
+    SetField(r,v.length);
+    memcpy(r+sizeof(SIZE_T),v.data,v.length);
+  } else {
+    SetField(r,ptr);
+  }
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNodeView::GetPrefixLength() const
+{
+  SIZE_T len=0;
+
+  if (info.format==BTREE_FORMAT_PREFIX) { 
+    memcpy(&len,data,sizeof(SIZE_T));
+  }
+  return len;
+}
+
+
+SIZE_T BTreeNodeView::GetStoredKeySize() const
+{
+  return info.keysize-GetPrefixLength();
+}
+
+
+char * BTreeNodeView::ResolvePrefix() const
+{
+  return info.format==BTREE_FORMAT_PREFIX ? data+sizeof(SIZE_T) : 0;
+}
+
+
+char * BTreeNodeView::ResolveKey(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return ResolveRecord(*this,offset)+sizeof(SIZE_T);
+    }
+    if (info.format==BTREE_FORMAT_SOA) { 
+      return data+offset*info.keysize;
+    }
+    return ResolveFirstPtr(*this)+sizeof(SIZE_T)+offset*GetSlotSize();
     break;
   default:
     return 0;
@@ -158,17 +367,24 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
 }
 
 
-char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+char * BTreeNodeView::ResolvePtr(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.format==BTREE_FORMAT_SLOTTED && offset>0) { 
+      char *r=ResolveRecord(*this,offset-1);
+      return r+sizeof(SIZE_T)+GetField(r);
+    }
+    if (info.format==BTREE_FORMAT_SOA) { 
+      return ResolveFirstPtr(*this)+offset*sizeof(SIZE_T);
+    }
+    return ResolveFirstPtr(*this)+offset*GetSlotSize();
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
-    return data;
+    return ResolveFirstPtr(*this);
     break;
   default:
     return 0;
@@ -177,12 +393,16 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveVal(const SIZE_T offset) const
+char * BTreeNodeView::ResolveVal(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info.format==BTREE_FORMAT_SLOTTED) { 
+      char *r=ResolveRecord(*this,offset);
+      return r+2*sizeof(SIZE_T)+GetField(r);
+    }
+    return ResolveKey(offset)+GetStoredKeySize();
     break;
   default:
     return 0;
@@ -191,12 +411,27 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+char * BTreeNodeView::ResolveKeyVal(const SIZE_T offset) const
 {
   return ResolveKey(offset);
 }
 
-ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+//
+// A key shorter than keysize is treated as if padded with zeros
+//
+static const char *PadKey(const KEY_T &k, const SIZE_T keysize, KEY_T &padded)
+{
+  if (k.length>=keysize) { 
+    return (const char *)k.data;
+  }
+  padded.Resize(keysize,false);
+  memset(padded.data,0,keysize);
+  memcpy(padded.data,k.data,k.length);
+  return (const char *)padded.data;
+}
+
+
+ERROR_T BTreeNodeView::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
 
@@ -204,12 +439,24 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T keylen=GetField(p-sizeof(SIZE_T));
+    k.Resize(keylen,false);
+    memcpy(k.data,p,keylen);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T prefixlen=GetPrefixLength();
+
   k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  if (prefixlen>0) { 
+    memcpy(k.data,ResolvePrefix(),prefixlen);
+  }
+  memcpy(k.data+prefixlen,p,info.keysize-prefixlen);
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+ERROR_T BTreeNodeView::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
 {
   char *p=ResolvePtr(offset);
 
@@ -221,7 +468,7 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+ERROR_T BTreeNodeView::GetVal(const SIZE_T offset, VALUE_T &v) const
 {
   char *p=ResolveVal(offset);
 
@@ -229,13 +476,20 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T vallen=GetField(p-sizeof(SIZE_T));
+    v.Resize(vallen,false);
+    memcpy(v.data,p,vallen);
+    return ERROR_NOERROR;
+  }
+
   v.Resize(info.valuesize,false);
   memcpy(v.data,p,info.valuesize);
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+ERROR_T BTreeNodeView::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 {
   ERROR_T rc= GetKey(offset,p.key);
 
@@ -247,21 +501,48 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
-ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+ERROR_T BTreeNodeView::SetKey(const SIZE_T offset, const KEY_T &k)
 {
+  ERROR_T rc;
+  KEY_T padded;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T ptr=0;
+    VALUE_T v;
+
+    if (offset>=info.numkeys) { 
+      return ERROR_NOMEM;
+    }
+    // The record is rewritten with the new key and what followed the old one
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      GetVal(offset,v);
+    } else {
+      GetPtr(offset+1,ptr);
+    }
+    return PutRecord(*this,offset,true,k,v,ptr);
+  }
+
+  const char *key=PadKey(k,info.keysize,padded);
+
+  if (info.format==BTREE_FORMAT_PREFIX) { 
+    if ((rc=FitPrefix(key,0))) { 
+      return rc;
+    }
+  }
+
   char *p=ResolveKey(offset);
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  memcpy(p,key+GetPrefixLength(),GetStoredKeySize());
 
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+ERROR_T BTreeNodeView::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 {
   char *p=ResolvePtr(offset);
 
@@ -276,21 +557,38 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 
 
-ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+ERROR_T BTreeNodeView::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
   char *p=ResolveVal(offset);
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
-  
-  memcpy(p,v.data,info.valuesize);
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    if (v.length==GetField(p-sizeof(SIZE_T))) { 
+      memcpy(p,v.data,v.length);
+      return ERROR_NOERROR;
+    }
+    // A value of another length needs a new record
+    KEY_T k;
+    GetKey(offset,k);
+    return PutRecord(*this,offset,true,k,v,0);
+  }
+
+  // A short value is padded with zeros
+  if (v.length<info.valuesize) { 
+    memcpy(p,v.data,v.length);
+    memset(p+v.length,0,info.valuesize-v.length);
+  } else {
+    memcpy(p,v.data,info.valuesize);
+  }
   
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+ERROR_T BTreeNodeView::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 {
   ERROR_T rc=SetKey(offset,p.key);
 
@@ -304,44 +602,852 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
-ostream & BTreeNode::Print(ostream &os) const 
+SIZE_T BTreeNodeView::GetLeftSibling() const
 {
-  os << "BTreeNode(info="<<info;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    os <<", ";
-    if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
-      SIZE_T ptr;
-      KEY_T key;
-      os << "pointers_and_values=(";
-      if (info.numkeys>0) { // ==0 implies an empty root node
-	for (SIZE_T i=0;i<info.numkeys;i++) {
-	  GetPtr(i,ptr);
-	  os<<ptr<<", ";
-	  GetKey(i,key);
-	  os<<key<<", ";
-	}
-	GetPtr(info.numkeys,ptr);
-	os <<ptr;
-      } 
-      os << ")";
-	
+  return info.leftsibling;
+}
+
+
+SIZE_T BTreeNodeView::GetRightSibling() const
+{
+  SIZE_T ptr=0;
+
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return info.rightsibling;
+  }
+  GetPtr(0,ptr);
+  return ptr;
+}
+
+
+void BTreeNodeView::SetLeftSibling(const SIZE_T node)
+{
+  info.leftsibling=node;
+}
+
+
+void BTreeNodeView::SetRightSibling(const SIZE_T node)
+{
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    if (IsLinked()) { 
+      info.rightsibling=node;
     }
-    if (info.nodetype==BTREE_LEAF_NODE) { 
-      KEY_T key;
-      VALUE_T val;
-      os << "keys_and_values=(";
-      for (SIZE_T i=0;i<info.numkeys;i++) {
-	if (i>0) { 
-	  os<<", ";
-	}
-	GetKey(i,key);
-	os<<key<<", ";
-	GetVal(i,val);
-	os<<val;
-      }
-      os <<")";
+    return;
+  }
+  SetPtr(0,node);
+}
+
+
+bool BTreeNodeView::IsLinked() const
+{
+  return info.highkeyroom!=0;
+}
+
+
+bool BTreeNodeView::HasHighKey() const
+{
+  return info.highkey!=0;
+}
+
+
+ERROR_T BTreeNodeView::GetHighKey(KEY_T &k) const
+{
+  if (!HasHighKey()) { 
+    return ERROR_NONEXISTENT;
+  }
+  k=KEY_T(info.highkey-1);
+  memcpy(k.data,data+info.GetNumDataBytes(),info.highkey-1);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::SetHighKey(const KEY_T &k)
+{
+  if (k.length>info.highkeyroom) { 
+    return ERROR_SIZE;
+  }
+  memcpy(data+info.GetNumDataBytes(),k.data,k.length);
+  info.highkey=k.length+1;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeNodeView::ClearHighKey()
+{
+  info.highkey=0;
+}
+
+
+void BTreeNodeView::CopyLinks(const BTreeNodeView &from)
+{
+  if (!IsLinked()) { 
+    return;
+  }
+  if (from.HasHighKey()) { 
+    memcpy(data+info.GetNumDataBytes(),from.data+from.info.GetNumDataBytes(),from.info.highkey-1);
+  }
+  info.highkey=from.info.highkey;
+  SetRightSibling(from.GetRightSibling());
+}
+
+
+bool BTreeNodeView::IsPastHighKey(const KEY_T &k) const
+{
+  if (!HasHighKey()) { 
+    return false;
+  }
+  // As CompareKeys, in place
+  const char *high=data+info.GetNumDataBytes();
+  SIZE_T len=info.highkey-1;
+  SIZE_T n = k.length<len ? k.length : len;
+  int c=memcmp(k.data,high,n);
+
+  if (c) { 
+    return c>0;
+  }
+  for (;n<k.length;n++) { 
+    if (k.data[n]) { 
+      return true;
     }
   }
-  os <<")";
-  return os;
+  return false;
+}
+
+
+char * BTreeNodeView::ResolveSlot(const SIZE_T offset) const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED || info.format==BTREE_FORMAT_SOA) { 
+    return 0;
+  }
+
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    assert(offset<=info.numkeys);
+    return ResolveFirstPtr(*this)+sizeof(SIZE_T)+offset*GetSlotSize();
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetSlotSize() const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return info.nodetype==BTREE_LEAF_NODE ?
+      3*sizeof(SIZE_T)+info.keysize+info.valuesize : 3*sizeof(SIZE_T)+info.keysize;
+  }
+  return info.nodetype==BTREE_LEAF_NODE ? 
+    GetStoredKeySize()+info.valuesize : GetStoredKeySize()+sizeof(SIZE_T);
+}
+
+
+SIZE_T BTreeNodeView::GetKeyStride() const
+{
+  return info.format==BTREE_FORMAT_SOA ? info.keysize : GetSlotSize();
+}
+
+
+SIZE_T BTreeNodeView::GetNumSlots() const
+{
+  if (info.format==BTREE_FORMAT_SOA) { 
+    return info.GetNumSlotsAsInterior();
+  }
+
+  SIZE_T header=ResolveFirstPtr(*this)-data+sizeof(SIZE_T);
+
+  return (info.GetNumDataBytes()-header)/GetSlotSize();  // floor intended
+}
+
+
+//
+// Split nodes: shifts keys from.. (and the pointers to their right)
+// to start at key to, within the node
+//
+static void ShiftColumns(BTreeNodeView &b, const SIZE_T from, const SIZE_T to)
+{
+  SIZE_T count=b.info.numkeys-from;
+
+  char *ptrs=ResolveFirstPtr(b);
+
+  memmove(b.data+to*b.info.keysize,b.data+from*b.info.keysize,count*b.info.keysize);
+  memmove(ptrs+(to+1)*sizeof(SIZE_T),ptrs+(from+1)*sizeof(SIZE_T),count*sizeof(SIZE_T));
+}
+
+
+ERROR_T BTreeNodeView::InsertSlots(const SIZE_T offset, const SIZE_T count)
+{
+  if (info.format==BTREE_FORMAT_SOA) { 
+    if (offset>info.numkeys) { 
+      return ERROR_SIZE;
+    }
+    if (info.numkeys+count > GetNumSlots()) { 
+      return ERROR_NOSPACE;
+    }
+    ShiftColumns(*this,offset,offset+count);
+    info.numkeys+=count;
+    return ERROR_NOERROR;
+  }
+
+  char *p=ResolveSlot(offset);
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+  if (info.numkeys+count > GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+
+  memmove(p+count*GetSlotSize(),p,(info.numkeys-offset)*GetSlotSize());
+  info.numkeys+=count;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::RemoveSlots(const SIZE_T offset, const SIZE_T count)
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    char *offsets=data+SLOTTED_HEADER;
+    SIZE_T freed=0;
+
+    if (offset+count > info.numkeys) { 
+      return ERROR_SIZE;
+    }
+    // The records themselves are left where they are until a Compact
+    for (SIZE_T i=offset;i<offset+count;i++) { 
+      freed+=GetRecordSize(*this,i)+sizeof(SIZE_T);
+    }
+    memmove(offsets+offset*sizeof(SIZE_T),offsets+(offset+count)*sizeof(SIZE_T),
+	    (info.numkeys-offset-count)*sizeof(SIZE_T));
+    SetField(data+sizeof(SIZE_T),GetField(data+sizeof(SIZE_T))+freed);
+    info.numkeys-=count;
+    return ERROR_NOERROR;
+  }
+
+  if (info.format==BTREE_FORMAT_SOA) { 
+    if (offset+count > info.numkeys) { 
+      return ERROR_SIZE;
+    }
+    ShiftColumns(*this,offset+count,offset);
+    info.numkeys-=count;
+    return ERROR_NOERROR;
+  }
+
+  char *p=ResolveSlot(offset);
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+  if (offset+count > info.numkeys) { 
+    return ERROR_SIZE;
+  }
+
+  memmove(p,p+count*GetSlotSize(),(info.numkeys-offset-count)*GetSlotSize());
+  info.numkeys-=count;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::CopySlots(const SIZE_T offset, const SIZE_T count, 
+				 BTreeNodeView &dest, const SIZE_T destoffset) const
+{
+  if (info.format==BTREE_FORMAT_SOA && dest.info.format==BTREE_FORMAT_SOA) { 
+    if (offset+count > info.numkeys || 
+	destoffset+count > dest.GetNumSlots() ||
+	info.keysize!=dest.info.keysize) { 
+      return ERROR_SIZE;
+    }
+    memmove(dest.data+destoffset*info.keysize,data+offset*info.keysize,count*info.keysize);
+    memmove(ResolveFirstPtr(dest)+(destoffset+1)*sizeof(SIZE_T),
+	    ResolveFirstPtr(*this)+(offset+1)*sizeof(SIZE_T),count*sizeof(SIZE_T));
+    return ERROR_NOERROR;
+  }
+
+  char *from=ResolveSlot(offset);
+  char *to=dest.ResolveSlot(destoffset);
+
+  if (from==0 || to==0) { 
+    return ERROR_NOMEM;
+  }
+  if (offset+count > info.numkeys || 
+      destoffset+count > dest.GetNumSlots() ||
+      GetSlotSize()!=dest.GetSlotSize()) { 
+    return ERROR_SIZE;
+  }
+
+  memmove(to,from,count*GetSlotSize());
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  ERROR_T rc;
+  KEY_T padded;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return PutRecord(*this,offset,false,k,v,0);
+  }
+
+  if (info.format==BTREE_FORMAT_PREFIX) { 
+    if ((rc=FitPrefix(PadKey(k,info.keysize,padded),1))) { 
+      return rc;
+    }
+  }
+  if ((rc=InsertSlots(offset,1))) { 
+    return rc;
+  }
+  if ((rc=SetKey(offset,k))) { 
+    return rc;
+  }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNodeView::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  ERROR_T rc;
+  KEY_T padded;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return PutRecord(*this,offset,false,k,VALUE_T(),ptr);
+  }
+
+  if (info.format==BTREE_FORMAT_PREFIX) { 
+    if ((rc=FitPrefix(PadKey(k,info.keysize,padded),1))) { 
+      return rc;
+    }
+  }
+  if ((rc=InsertSlots(offset,1))) { 
+    return rc;
+  }
+  if ((rc=SetKey(offset,k))) { 
+    return rc;
+  }
+  return SetPtr(offset+1,ptr);
+}
+
+
+ERROR_T BTreeNodeView::MoveSlots(const SIZE_T offset, BTreeNodeView &dest)
+{
+  ERROR_T rc;
+
+  if (offset>info.numkeys || dest.info.numkeys!=0) { 
+    return ERROR_SIZE;
+  }
+
+  SIZE_T count=info.numkeys-offset;
+
+  // Nodes of different formats can sit side by side in one tree (say
+  // an index reorganized into another format one split at a time), so
+  // between them entries are copied one by one through the accessors
+  if (dest.info.format!=info.format) { 
+    KEY_T k;
+    VALUE_T v;
+    SIZE_T ptr;
+    for (SIZE_T i=offset;i<info.numkeys;i++) { 
+      if ((rc=GetKey(i,k))) { 
+	return rc;
+      }
+      if (info.nodetype==BTREE_LEAF_NODE) { 
+	if ((rc=GetVal(i,v)) || (rc=dest.InsertKeyVal(i-offset,k,v))) { 
+	  return rc;
+	}
+      } else {
+	if ((rc=GetPtr(i+1,ptr)) || (rc=dest.InsertKeyPtr(i-offset,k,ptr))) { 
+	  return rc;
+	}
+      }
+    }
+    return RemoveSlots(offset,count);
+  }
+
+  // Records are copied whole, one at a time
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    for (SIZE_T i=offset;i<info.numkeys;i++) { 
+      SIZE_T size=GetRecordSize(*this,i);
+      char *r=AllocateRecord(dest,dest.info.numkeys,size);
+      if (r==0) { 
+	return ERROR_NOSPACE;
+      }
+      memcpy(r,ResolveRecord(*this,i),size);
+    }
+    return RemoveSlots(offset,count);
+  }
+
+  // dest takes on this node's prefix so the slots can be copied as is
+  if (info.format==BTREE_FORMAT_PREFIX) { 
+    if ((rc=dest.Repack(GetPrefixLength(),ResolvePrefix(),count))) { 
+      return rc;
+    }
+  }
+  if ((rc=CopySlots(offset,count,dest,0))) { 
+    return rc;
+  }
+  dest.info.numkeys=count;
+  info.numkeys=offset;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNodeView::Compact()
+{
+  ERROR_T rc;
+  KEY_T first, last;
+  SIZE_T len;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    Defragment(*this);
+    return ERROR_NOERROR;
+  }
+  if (info.format!=BTREE_FORMAT_PREFIX || info.numkeys==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // Keys are sorted, so what the first and last share all of them share
+  if ((rc=GetKey(0,first)) || (rc=GetKey(info.numkeys-1,last))) { 
+    return rc;
+  }
+  for (len=0; len<info.keysize && first.data[len]==last.data[len]; len++) { 
+  }
+
+  return len>GetPrefixLength() ? Repack(len,(const char *)first.data,0) : ERROR_NOERROR;
+}
+
+
+void BTreeNodeView::Clear(const SIZE_T format)
+{
+  SIZE_T numbytes=info.GetNumDataBytes();
+
+  info.numkeys=0;
+  info.format=format;
+  info.leftsibling=0;
+  info.rightsibling=0;
+  info.highkey=0;
+  memset(data,0,numbytes);
+
+  if (format==BTREE_FORMAT_SLOTTED) { 
+    SetField(data,numbytes);
+    SetField(data+sizeof(SIZE_T),numbytes-SLOTTED_HEADER);
+  }
+}
+
+
+SIZE_T BTreeNodeView::GetSplitOffset(const double fraction) const
+{
+  SIZE_T n=info.numkeys;
+  SIZE_T total=0, before=0, i;
+  // Each side keeps a key, and the left side of an interior node a
+  // key besides the one that moves up
+  SIZE_T lo = info.nodetype==BTREE_LEAF_NODE ? 1 : 2;
+
+  if (n<lo+1) { 
+    return n/2;
+  }
+
+  if (info.format!=BTREE_FORMAT_SLOTTED) { 
+    i=(SIZE_T)(n*fraction);
+  } else {
+    // Entries vary in size, so split by bytes rather than by count
+    for (i=0;i<n;i++) { 
+      total+=GetRecordSize(*this,i);
+    }
+    for (i=0;i<n-1 && before<fraction*total;i++) { 
+      before+=GetRecordSize(*this,i);
+    }
+  }
+  return i<lo ? lo : i>n-1 ? n-1 : i;
+}
+
+
+double BTreeNodeView::GetFill() const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T usable=info.GetNumDataBytes()-SLOTTED_HEADER;
+    return (usable-GetField(data+sizeof(SIZE_T)))/(double)usable;
+  }
+  return info.numkeys/(double)GetNumSlots();
+}
+
+
+bool BTreeNodeView::HasRoomForEntry() const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return GetField(data+sizeof(SIZE_T))>=GetSlotSize();
+  }
+  return info.numkeys<GetNumSlots();
+}
+
+
+ERROR_T BTreeNodeView::FitPrefix(const char *key, const SIZE_T extraslots)
+{
+  SIZE_T prefixlen=GetPrefixLength();
+  const char *prefix=ResolvePrefix();
+  SIZE_T len;
+
+  // An empty node takes all of its first key as the prefix
+  if (info.numkeys==0) { 
+    return Repack(info.keysize,key,extraslots);
+  }
+
+  for (len=0; len<prefixlen && prefix[len]==key[len]; len++) { 
+  }
+
+  if (len<prefixlen) { 
+    return Repack(len,key,extraslots);
+  }
+  return info.numkeys+extraslots<=GetNumSlots() ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+
+ERROR_T BTreeNodeView::Repack(const SIZE_T prefixlen, const char *prefix, const SIZE_T extraslots)
+{
+  SIZE_T numbytes=info.GetNumDataBytes();
+  SIZE_T oldlen=GetPrefixLength();
+  SIZE_T payload = info.nodetype==BTREE_LEAF_NODE ? info.valuesize : sizeof(SIZE_T);
+  SIZE_T oldslotsize=info.keysize-oldlen+payload;
+  SIZE_T slotsize=info.keysize-prefixlen+payload;
+
+  if (info.format!=BTREE_FORMAT_PREFIX || prefixlen>info.keysize) { 
+    return ERROR_SIZE;
+  }
+  if (2*sizeof(SIZE_T)+prefixlen+(info.numkeys+extraslots)*slotsize > numbytes) { 
+    return ERROR_NOSPACE;
+  }
+
+  // Old and new slots overlap, so work from a copy of the node
+  char *old=new char [numbytes];
+  memcpy(old,data,numbytes);
+  if (prefix>=data && prefix<data+numbytes) { 
+    prefix=old+(prefix-data);
+  }
+
+  const char *oldprefix=old+sizeof(SIZE_T);
+  const char *from=oldprefix+oldlen;
+  char *to=data+sizeof(SIZE_T)+prefixlen;
+
+  memcpy(data,&prefixlen,sizeof(SIZE_T));
+  memcpy(data+sizeof(SIZE_T),prefix,prefixlen);
+
+  // First pointer
+  memcpy(to,from,sizeof(SIZE_T));
+  from+=sizeof(SIZE_T);
+  to+=sizeof(SIZE_T);
+
+  // Each key is the old prefix then the old suffix; keep what
+  // follows the new prefix, then the value or pointer
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    if (prefixlen<oldlen) { 
+      memcpy(to,oldprefix+prefixlen,oldlen-prefixlen);
+      memcpy(to+oldlen-prefixlen,from,oldslotsize);
+    } else {
+      memcpy(to,from+prefixlen-oldlen,slotsize);
+    }
+    from+=oldslotsize;
+    to+=slotsize;
+  }
+
+  delete [] old;
+
+  return ERROR_NOERROR;
+}
+
+
+//
+// Two byte strings compared as if the shorter were padded with zeros
+//
+static int CompareBytes(const char *a, const SIZE_T alen, const char *b, const SIZE_T blen)
+{
+  SIZE_T n = alen<blen ? alen : blen;
+  int c=memcmp(a,b,n);
+
+  if (c!=0) { 
+    return c;
+  }
+  for (SIZE_T i=n;i<alen;i++) { 
+    if (a[i]) { 
+      return 1;
+    }
+  }
+  for (SIZE_T i=n;i<blen;i++) { 
+    if (b[i]) { 
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+//
+// A probe key shorter than keysize compares as if padded with zeros
+//
+static int CompareKeyBytes(const char *slot, const SIZE_T keysize, const KEY_T &k)
+{
+  if (k.length>=keysize) { 
+    return memcmp(slot,k.data,keysize);
+  }
+
+  int c=memcmp(slot,k.data,k.length);
+
+  if (c!=0) { 
+    return c;
+  }
+  for (SIZE_T i=k.length;i<keysize;i++) { 
+    if (slot[i]) { 
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+int BTreeNodeView::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    const char *r=ResolveRecord(*this,offset);
+    return CompareBytes(r+sizeof(SIZE_T),GetField(r),
+			(const char *)k.data,k.length<info.keysize ? k.length : info.keysize);
+  }
+
+  SIZE_T prefixlen=GetPrefixLength();
+
+  if (prefixlen==0) { 
+    return CompareKeyBytes(ResolveKey(offset),info.keysize,k);
+  }
+
+  KEY_T padded;
+  const char *key=PadKey(k,info.keysize,padded);
+  int c=memcmp(ResolvePrefix(),key,prefixlen);
+
+  return c!=0 ? c : memcmp(ResolveKey(offset),key+prefixlen,info.keysize-prefixlen);
+}
+
+
+int CompareKeys(const KEY_T &a, const KEY_T &b)
+{
+  if (a.length>=b.length) { 
+    return CompareKeyBytes((const char *)a.data,a.length,b);
+  } else {
+    return -CompareKeyBytes((const char *)b.data,b.length,a);
+  }
+}
+
+
+//
+// Kernels are looked up once; only 8 and 16 byte keys have one
+//
+static KeySearchFn KernelFor(const SIZE_T keysize)
+{
+  static KeySearchFn kernel8=GetKeySearchKernel(8);
+  static KeySearchFn kernel16=GetKeySearchKernel(16);
+
+  return keysize==8 ? kernel8 : keysize==16 ? kernel16 : 0;
+}
+
+
+SIZE_T BTreeNodeView::LowerBound(const KEY_T &k) const
+{
+  SIZE_T n=info.numkeys;
+
+  if (n==0) { 
+    return 0;
+  }
+
+  // Keys in a slotted node vary in length, so are compared one by one
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T probelen = k.length<info.keysize ? k.length : info.keysize;
+    SIZE_T lo=0, hi=n;
+    while (lo<hi) { 
+      SIZE_T mid=(lo+hi)/2;
+      const char *r=ResolveRecord(*this,mid);
+      if (CompareBytes(r+sizeof(SIZE_T),GetField(r),(const char *)k.data,probelen)<0) { 
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  KEY_T padded;
+  const char *probe=PadKey(k,info.keysize,padded);
+  SIZE_T keybytes=info.keysize;
+  SIZE_T prefixlen=GetPrefixLength();
+
+  // Every key here shares the prefix, so unless the probe does too
+  // the prefix alone decides; if it does, only suffixes are compared
+  if (prefixlen>0) { 
+    int c=memcmp(ResolvePrefix(),probe,prefixlen);
+    if (c!=0) { 
+      return c>0 ? 0 : n;
+    }
+    probe+=prefixlen;
+    keybytes-=prefixlen;
+  }
+
+  const char *first=ResolveKey(0);
+  SIZE_T stride=GetKeyStride();
+  SIZE_T base=0;
+  KeySearchFn kernel=KernelFor(keybytes);
+  SIZE_T window = kernel ? KEYSEARCH_LINEAR_WINDOW : 1;
+
+  // Narrow [base,base+n) by halves; written so the compiler can
+  // use a conditional move instead of a branch
+  while (n>window) { 
+    SIZE_T half=n/2;
+    base = memcmp(first+(base+half)*stride,probe,keybytes)<0 ? base+half : base;
+    n-=half;
+  }
+
+  // The last few slots are compared all at once
+  if (kernel) { 
+    return base + kernel(first+base*stride,stride,n,probe);
+  }
+
+  return base + (memcmp(first+base*stride,probe,keybytes)<0 ? 1 : 0);
+}
+
+
+BTreeNodeView BTreeNode::View() const
+{
+  return BTreeNodeView((NodeMetadata &)info,data);
+}
+
+
+char * BTreeNode::ResolveKey(const SIZE_T offset) const
+{
+  return View().ResolveKey(offset);
+}
+
+
+char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+{
+  return View().ResolvePtr(offset);
+}
+
+
+char * BTreeNode::ResolveVal(const SIZE_T offset) const
+{
+  return View().ResolveVal(offset);
+}
+
+
+char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+{
+  return View().ResolveKeyVal(offset);
+}
+
+
+ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
+{
+  return View().GetKey(offset,k);
+}
+
+
+ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+{
+  return View().GetPtr(offset,ptr);
+}
+
+
+ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+{
+  return View().GetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
+{
+  return View().GetKeyVal(offset,p);
+}
+
+
+ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+{
+  return View().SetKey(offset,k);
+}
+
+
+ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
+{
+  return View().SetPtr(offset,ptr);
+}
+
+
+ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+{
+  return View().SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
+{
+  return View().SetKeyVal(offset,p);
+}
+
+
+ostream & BTreeNodeView::Print(ostream &os) const 
+{
+  os << "BTreeNode(info="<<info;
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
+    os <<", ";
+    if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
+      SIZE_T ptr;
+      KEY_T key;
+      os << "pointers_and_values=(";
+      if (info.numkeys>0) { // ==0 implies an empty root node
+	for (SIZE_T i=0;i<info.numkeys;i++) {
+	  GetPtr(i,ptr);
+	  os<<ptr<<", ";
+	  GetKey(i,key);
+	  os<<key<<", ";
+	}
+	GetPtr(info.numkeys,ptr);
+	os <<ptr;
+      } 
+      os << ")";
+	
+    }
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      KEY_T key;
+      VALUE_T val;
+      os << "keys_and_values=(";
+      for (SIZE_T i=0;i<info.numkeys;i++) {
+	if (i>0) { 
+	  os<<", ";
+	}
+	GetKey(i,key);
+	os<<key<<", ";
+	GetVal(i,val);
+	os<<val;
+      }
+      os <<")";
+    }
+  }
+  os <<")";
+  return os;
+}
+
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  return View().CompareKey(offset,k);
+}
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &k) const
+{
+  return View().LowerBound(k);
+}
+
+
+ostream & BTreeNode::Print(ostream &os) const 
+{
+  return View().Print(os);
 }
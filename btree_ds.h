@@ -14,6 +14,25 @@ using namespace std;
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
 
+// Layouts of a node's data area (NodeMetadata::format)
+#define BTREE_FORMAT_CLASSIC 0
+#define BTREE_FORMAT_PREFIX 1
+#define BTREE_FORMAT_SLOTTED 2
+#define BTREE_FORMAT_SOA 3      // interior nodes only
+
+// Options an index is created with (the superblock's format field)
+#define BTREE_OPT_PREFIX 0x1    // prefix-compressed nodes
+#define BTREE_OPT_TRUNCATE 0x2  // shortest separators, in slotted interior nodes
+#define BTREE_OPT_VARLEN 0x4    // variable-length keys and values, in slotted nodes
+#define BTREE_OPT_INTKEYS 0x8   // 8 byte signed integer keys
+#define BTREE_OPT_UINTKEYS 0x10 // 8 byte unsigned integer keys
+#define BTREE_OPT_SOA 0x20      // keys apart from pointers, in fixed-size interior nodes
+#define BTREE_OPT_LAZYDELETE 0x40 // deletes merge away only nodes they empty
+#define BTREE_OPT_SPLITFULL 0x80  // inserts split nodes only once full
+#define BTREE_OPT_BSTAR 0x100     // the same, sharing with siblings first
+#define BTREE_OPT_APPENDSPLIT 0x200 // nodes split at the right edge keep most entries
+#define BTREE_OPT_TOPDOWN 0x400   // inserts split full nodes on the way down
+#define BTREE_OPT_BLINK 0x800     // nodes keep a high key and a link to the right (B-link tree)
 
 typedef Block Buffer;
 typedef Buffer KeyOrValue;
@@ -32,7 +51,14 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
-
+  SIZE_T format;   //BTREE_FORMAT_* of the node, or BTREE_OPT_* for the superblock
+  SIZE_T leftsibling; //meaningful only for a leaf
+  SIZE_T rightsibling; //meaningful only for an interior node of a B-link index
+  SIZE_T highkeyroom; //bytes kept after the data area for a high key (B-link), or 0
+  SIZE_T highkey;  //1 + the length of the high key kept there, or 0 for none
+
+  // Bytes after the metadata: the data area, then room for a high key
+  SIZE_T GetNumPayloadBytes() const;
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
@@ -55,7 +81,153 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the leaf to the right (see GetRightSibling)
+//
+// B-link (BTREE_OPT_BLINK) nodes of any format and type:
+//
+// ... DATA AREA ... HIGHKEY
+//
+// The last keysize bytes of the block (NodeMetadata::highkeyroom) are
+// kept out of the data area for the node's high key: the largest key
+// that belongs in it, which is also the key to its right in its
+// parent.  The last node of each level has none.  Interior nodes are
+// chained to the right as well, through their metadata, so a node
+// just split can be left for its right half whether or not the parent
+// knows about that half yet.
+//
+// Prefix-compressed (BTREE_FORMAT_PREFIX) interior node and leaf:
+//
+// PREFIXLEN PREFIX PTR SUFFIX PTR SUFFIX PTR
+// PREFIXLEN PREFIX PTR* SUFFIX VALUE SUFFIX VALUE
+//
+// Every key in the node starts with the same PREFIXLEN bytes, which
+// are stored once; each slot holds only the other keysize-PREFIXLEN.
+// The prefix is shortened when a key that does not share it comes in
+// and lengthened again (Compact) after a split.
+//
+// Slotted (BTREE_FORMAT_SLOTTED) interior node and leaf:
+//
+// HEAP FREE PTR OFFSET OFFSET OFFSET ... RECORD RECORD RECORD
+// HEAP FREE PTR* OFFSET OFFSET OFFSET ... RECORD RECORD RECORD
+//
+// Keys here may be any length up to keysize, and values any length
+// up to valuesize.  OFFSET i is where the record for key i starts;
+// records are packed at the end of the block in no particular order,
+// and HEAP is where the lowest one starts.  FREE counts every unused
+// byte, including those of removed records that Compact has not yet
+// reclaimed.  An interior record is KEYLEN KEY PTR, PTR being the
+// pointer to the right of KEY, and a leaf record KEYLEN KEY VALLEN VALUE.
+//
+// Split (BTREE_FORMAT_SOA) interior node:
+//
+// KEY KEY KEY ... PTR PTR PTR PTR ...
+//
+// The same keys and pointers as a classic interior node, but all the
+// keys come first, one after the other, and the pointers start after
+// room for as many keys as a classic node holds.  A search then reads
+// only keys.  Slot i is still key i and pointer i+1; the slot
+// operations move both halves.
+
+
+//
+// A non-owning view of a node stored somewhere else, typically a
+// buffer cache frame held by a PinnedBlock.  Everything operates in
+// place on that memory - nothing is allocated or copied.
+//
+struct BTreeNodeView {
+  NodeMetadata &info;
+  char         *data;
+
+  BTreeNodeView(NodeMetadata &info, char *data);
+  BTreeNodeView(Block &frame);   // a whole serialized node
+
+  char *ResolvePrefix() const; // Gives a pointer to the common prefix (prefix-compressed)
+  char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key as stored (interior or leaf)
+  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
+  char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
+  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+
+  SIZE_T GetPrefixLength() const;    // Zero unless prefix-compressed
+  SIZE_T GetStoredKeySize() const;   // Bytes of each key kept in its slot
+
+  ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
+  ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
+
+  ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
+  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
+  ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
+
+  // Leaves are chained in key order.  The right sibling is kept in the
+  // leaf's first pointer, the left one in its metadata; 0 means none
+  SIZE_T  GetLeftSibling() const;
+  SIZE_T  GetRightSibling() const;
+  void    SetLeftSibling(const SIZE_T node);
+  void    SetRightSibling(const SIZE_T node);
+
+  // B-link indexes.  The high key of a node that has one, kept in full
+  // (not prefix-compressed or shortened further); every key in the
+  // node is no greater.  Interior nodes are chained to the right only
+  // in a B-link index (IsLinked); elsewhere their links are always 0.
+  bool    IsLinked() const;
+  bool    HasHighKey() const;
+  ERROR_T GetHighKey(KEY_T &k) const;
+  ERROR_T SetHighKey(const KEY_T &k);  // ERROR_SIZE unless linked and k fits
+  void    ClearHighKey();
+  void    CopyLinks(const BTreeNodeView &from);  // takes over from's high key and right link
+  bool    IsPastHighKey(const KEY_T &k) const;  // k belongs to a node further right
+
+  // Whole-entry edits that work for every format.  They return
+  // ERROR_NOSPACE, leaving the node as it was, if the entry does not fit
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v); // New key and value at offset (leaf)
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);  // New key at offset, p to its right (interior)
+  ERROR_T MoveSlots(const SIZE_T offset, BTreeNodeView &dest); // Moves slots offset.. to the empty node dest, of any format
+  ERROR_T Compact();  // Lengthens the prefix to all the keys now share; defragments a slotted node
+
+  void    Clear(const SIZE_T format);  // Empties the node and lays it out in format, unlinked
+  double  GetFill() const;             // Fraction of the node's space holding entries
+  bool    HasRoomForEntry() const;     // Whether an entry of the largest size fits (bar a shorter prefix)
+  SIZE_T  GetSplitOffset(const double fraction=0.5) const; // Where to split to leave about fraction of the node on the left
+
+  // Prefix-compressed nodes: rewrite the node around a new prefix,
+  // failing with ERROR_NOSPACE unless extraslots more slots would fit
+  ERROR_T FitPrefix(const char *key, const SIZE_T extraslots); // Shortens the prefix to one key shares
+  ERROR_T Repack(const SIZE_T prefixlen, const char *prefix, const SIZE_T extraslots);
+
+  // A slot is a key and what follows it: its value in a leaf, or the
+  // pointer to its right in an interior node.  Slots are contiguous,
+  // so ranges of them can be shifted or copied with one memmove.
+  // Slotted nodes have records instead, which are not contiguous, so
+  // ResolveSlot, InsertSlots and CopySlots do not apply to them.  Split
+  // nodes keep keys and pointers apart, so ResolveSlot gives 0 for
+  // them, but the rest shift or copy the keys and pointers separately.
+  char   *ResolveSlot(const SIZE_T offset) const; // Gives a pointer to the ith slot (may be one past the end)
+  SIZE_T  GetSlotSize() const; // For a slotted node, the largest an entry can take up
+  SIZE_T  GetKeyStride() const; // Bytes from one stored key to the next (not slotted)
+  SIZE_T  GetNumSlots() const; // Capacity of this node (for a slotted node, in the largest entries)
+
+  ERROR_T InsertSlots(const SIZE_T offset, const SIZE_T count); // Opens count uninitialized slots at offset
+  ERROR_T RemoveSlots(const SIZE_T offset, const SIZE_T count); // Closes up count slots at offset
+  ERROR_T CopySlots(const SIZE_T offset, const SIZE_T count,    // Overwrites count slots of dest at destoffset
+		    BTreeNodeView &dest, const SIZE_T destoffset) const;
+
+  // Compares the ith key, in place, against k: <0, 0, >0 like memcmp
+  int     CompareKey(const SIZE_T offset, const KEY_T &k) const;
+  // Binary search: the offset of the first key >= k, or numkeys if none.
+  // For an interior node this is also the offset of the pointer to follow
+  SIZE_T  LowerBound(const KEY_T &k) const;
+
+  ostream &Print(ostream &rhs) const;
+};
+
+
+inline ostream & operator<<(ostream &os, const BTreeNodeView &node) { return node.Print(os); }
+
+// Compares keys the way nodes order them: like memcmp, with the
+// shorter of the two compared as if padded with zeros
+int CompareKeys(const KEY_T &a, const KEY_T &b);
 
 
 struct BTreeNode {
@@ -97,6 +269,12 @@ struct BTreeNode {
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  int     CompareKey(const SIZE_T offset, const KEY_T &k) const;
+  SIZE_T  LowerBound(const KEY_T &k) const;
+
+  // All of the accessors above are those of a view over this node
+  BTreeNodeView View() const;
+
   ostream &Print(ostream &rhs) const;
 };
 
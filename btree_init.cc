@@ -4,7 +4,18 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [option ...]\n";
+  cerr << "options: PREFIX (prefix-compressed nodes)\n";
+  cerr << "         TRUNCATE (shortest separators in interior nodes)\n";
+  cerr << "         VARLEN (variable-length keys and values)\n";
+  cerr << "         INTKEYS, UINTKEYS (8 byte integer keys)\n";
+  cerr << "         SOA (interior keys stored apart from pointers)\n";
+  cerr << "         LAZYDELETE (deletes merge away only empty nodes)\n";
+  cerr << "         SPLITFULL (split nodes only once full)\n";
+  cerr << "         BSTAR (share with siblings, split two leaves into three)\n";
+  cerr << "         APPENDSPLIT (keep nodes full under ascending inserts)\n";
+  cerr << "         TOPDOWN (inserts split full nodes on the way down)\n";
+  cerr << "         BLINK (high keys and right links, for concurrent inserts)\n";
 }
 
 
@@ -13,8 +24,9 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  SIZE_T options=0;
 
-  if (argc!=5) { 
+  if (argc<5) { 
     usage();
     return -1;
   }
@@ -24,9 +36,17 @@ int main(int argc, char **argv)
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
 
+  for (int i=5;i<argc;i++) { 
+    if (GetIndexOption(argv[i])==0) { 
+      usage();
+      return -1;
+    }
+    options|=GetIndexOption(argv[i]);
+  }
+
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,options);
   
   ERROR_T rc;
 
@@ -29,6 +29,7 @@ int main(int argc, char **argv)
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
+  KEY_T k;
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) { 
     cerr << "Can't attach buffer cache due to error"<<rc<<endl;
@@ -40,7 +41,7 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    if ((rc=btree.Insert(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) { 
+    if ((rc=btree.ParseKey(key,k)) || (rc=btree.Insert(k,VALUE_T(value)))!=ERROR_NOERROR) { 
       cerr <<"Can't insert into index due to error "<<rc<<endl;
     } else {
       cerr <<"Insert succeeded\n";
@@ -0,0 +1,187 @@
+#include <sched.h>
+
+#include "btree_latch.h"
+
+void NodeLatch::LockShared()
+{
+  while (true) {
+    unsigned long long s=state.load(memory_order_relaxed);
+    if (!(s & (WRITER|WAITING)) &&
+	state.compare_exchange_weak(s,s+1,memory_order_acquire)) {
+      return;
+    }
+    sched_yield();
+  }
+}
+
+void NodeLatch::LockExclusive()
+{
+  while (true) {
+    unsigned long long s=state.load(memory_order_relaxed);
+    // Free but for other writers waiting, who have to try again
+    if ((s & (VERSION-1) & ~WAITING)==0 &&
+	state.compare_exchange_weak(s,(s & ~(VERSION-1)) | WRITER,memory_order_acquire)) {
+      return;
+    }
+    if (!(s & WAITING)) {
+      state.fetch_or(WAITING,memory_order_relaxed);
+    }
+    sched_yield();
+  }
+}
+
+
+bool NodeLatch::ReadVersion(VERSION_T &v) const
+{
+  unsigned long long s=state.load(memory_order_acquire);
+
+  v=s>>32;
+  return !(s & WRITER);
+}
+
+bool NodeLatch::Validate(const VERSION_T v) const
+{
+  // The reads being validated come before this one
+  atomic_thread_fence(memory_order_acquire);
+  unsigned long long s=state.load(memory_order_relaxed);
+
+  return !(s & WRITER) && (s>>32)==v;
+}
+
+
+void NodeLatchTable::Resize(const SIZE_T numblocks)
+{
+  latches=vector<NodeLatch>(numblocks);
+}
+
+
+void LatchSet::LockShared(const SIZE_T blocknum)
+{
+  table->Get(blocknum).LockShared();
+  held.push_back(make_pair(blocknum,false));
+}
+
+void LatchSet::LockExclusive(const SIZE_T blocknum)
+{
+  table->Get(blocknum).LockExclusive();
+  held.push_back(make_pair(blocknum,true));
+}
+
+void LatchSet::Release(const SIZE_T blocknum)
+{
+  for (SIZE_T i=0;i<held.size();i++) {
+    if (held[i].first==blocknum) {
+      if (held[i].second) {
+	table->Get(blocknum).UnlockExclusive();
+      } else {
+	table->Get(blocknum).UnlockShared();
+      }
+      held.erase(held.begin()+i);
+      return;
+    }
+  }
+}
+
+void LatchSet::ReleaseAllBut(const SIZE_T blocknum)
+{
+  while (!held.empty() && held.front().first!=blocknum) {
+    Release(held.front().first);
+  }
+}
+
+void LatchSet::ReleaseAll()
+{
+  // Last latched first
+  while (!held.empty()) {
+    Release(held.back().first);
+  }
+}
+
+void LatchSet::ReleaseAllUnchanged()
+{
+  while (!held.empty()) {
+    if (held.back().second) {
+      table->Get(held.back().first).UnlockExclusiveUnchanged();
+    } else {
+      table->Get(held.back().first).UnlockShared();
+    }
+    held.pop_back();
+  }
+}
+
+
+TreeGate::TreeGate() : closed(false)
+{
+  for (SIZE_T i=0;i<TREEGATE_SLOTS;i++) {
+    slots[i].holders=0;
+  }
+}
+
+SIZE_T TreeGate::MySlot()
+{
+  // Threads take the slots in turn, so the first TREEGATE_SLOTS
+  // threads each have one to themselves
+  static atomic<SIZE_T> next(0);
+  static thread_local SIZE_T mine=next.fetch_add(1)%TREEGATE_SLOTS;
+
+  return mine;
+}
+
+void TreeGate::lock_shared()
+{
+  Slot &s=slots[MySlot()];
+
+  while (true) {
+    s.holders.fetch_add(1);
+    if (!closed.load()) {
+      return;
+    }
+    // A writer is in or on its way; keep out of its way until it is done
+    s.holders.fetch_sub(1);
+    while (closed.load(memory_order_relaxed)) {
+      sched_yield();
+    }
+  }
+}
+
+void TreeGate::unlock_shared()
+{
+  slots[MySlot()].holders.fetch_sub(1,memory_order_release);
+}
+
+void TreeGate::lock()
+{
+  writers.lock();
+  closed.store(true);
+  for (SIZE_T i=0;i<TREEGATE_SLOTS;i++) {
+    while (slots[i].holders.load()) {
+      sched_yield();
+    }
+  }
+}
+
+void TreeGate::unlock()
+{
+  closed.store(false,memory_order_release);
+  writers.unlock();
+}
+
+
+TreeLock::TreeLock(TreeGate &mutex, const bool on, const bool sh) :
+  m(on ? &mutex : 0), shared(sh)
+{
+  if (m && shared) {
+    m->lock_shared();
+  } else if (m) {
+    m->lock();
+  }
+}
+
+TreeLock::~TreeLock()
+{
+  if (m && shared) {
+    m->unlock_shared();
+  } else if (m) {
+    m->unlock();
+  }
+}
@@ -0,0 +1,173 @@
+#ifndef _btree_latch
+#define _btree_latch
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Latches for driving one BTreeIndex from several threads (see
+// BTreeIndex::SetConcurrent).
+//
+// Every block of the disk has a reader/writer latch.  Lookups, updates
+// and inserts latch their way down the tree hand over hand: a node is
+// latched before its parent is let go, and a writer holds on to the
+// parent only while the node below might still split into it.  The
+// latch of the superblock stands for the root pointer, so a new root
+// is published while it is held exclusively.
+//
+// Latches are held for a few key compares at a time, so a waiter
+// spins (yielding the CPU) rather than sleeping.  A writer waiting on
+// a latch keeps new readers out of it, so a latch on the upper levels
+// that readers pass through all the time is still got.
+//
+// Taking even a shared latch writes to it, so the latches on the top
+// levels, which every operation passes through, bounce from core to
+// core.  Each latch therefore also has a version, which goes up every
+// time a writer lets go of it.  Optimistic lock coupling reads a node
+// without latching it: it notes the version, reads, and checks the
+// version is still the same (Validate), starting again if not.
+//
+
+// A latch's version, which says whether its node may have changed
+typedef unsigned long long VERSION_T;
+
+class NodeLatch {
+ private:
+  // The version in the high half; readers holding the latch in the
+  // low bits, and the two flags
+  atomic<unsigned long long> state;
+
+  static const unsigned long long WRITER = 1ULL<<30;    // held exclusively
+  static const unsigned long long WAITING = 1ULL<<29;  // a writer is waiting for it
+  static const unsigned long long VERSION = 1ULL<<32;  // one version up
+
+  NodeLatch(const NodeLatch &rhs);
+  NodeLatch & operator=(const NodeLatch &rhs);
+ public:
+  NodeLatch() : state(0) {}
+
+  void LockShared();
+  void UnlockShared() { state.fetch_sub(1,memory_order_release); }
+  void LockExclusive();
+  // Any other writer's WAITING stays set, ahead of readers
+  void UnlockExclusive() { state.fetch_add(VERSION-WRITER,memory_order_release); }
+  // For a writer that changed nothing after all: the version stays, so
+  // optimistic readers need not start again (nor writers that fail
+  // this way set each other back without end)
+  void UnlockExclusiveUnchanged() { state.fetch_sub(WRITER,memory_order_release); }
+
+  // Optimistic reads.  ReadVersion is false while a writer holds the
+  // latch; Validate is true if no writer has held it since v was read.
+  bool ReadVersion(VERSION_T &v) const;
+  bool Validate(const VERSION_T v) const;
+  // The version, for comparing with one read before while holding the
+  // latch
+  VERSION_T GetVersion() const { return state.load(memory_order_acquire)>>32; }
+};
+
+
+// One latch per block, for a disk of numblocks blocks
+class NodeLatchTable {
+ private:
+  vector<NodeLatch> latches;
+
+  NodeLatchTable & operator=(const NodeLatchTable &rhs);
+ public:
+  NodeLatchTable() {}
+  // A copy has latches of its own, none of them held
+  NodeLatchTable(const NodeLatchTable &rhs) : latches(rhs.latches.size()) {}
+
+  // Must not be called while any latch is held
+  void       Resize(const SIZE_T numblocks);
+  NodeLatch &Get(const SIZE_T blocknum) { return latches[blocknum]; }
+};
+
+
+//
+// The latches one operation holds, let go of when it goes out of
+// scope.  Anything pinned under a latch has to be unpinned before the
+// latch is let go (declare the PinnedBlock after the LatchSet), since
+// that is when the decoded copies of a changed node are dropped.
+//
+class LatchSet {
+ private:
+  NodeLatchTable *table;
+  // Blocks latched, in the order they were latched, and whether
+  // exclusively
+  vector<pair<SIZE_T,bool> > held;
+
+  LatchSet(const LatchSet &rhs);
+  LatchSet & operator=(const LatchSet &rhs);
+ public:
+  LatchSet(NodeLatchTable &table) : table(&table) {}
+  ~LatchSet() { ReleaseAll(); }
+
+  void LockShared(const SIZE_T blocknum);
+  void LockExclusive(const SIZE_T blocknum);
+  void Release(const SIZE_T blocknum);
+  // Lets go of everything, having changed none of it
+  void ReleaseAllUnchanged();
+  // Crabbing: lets go of everything latched before blocknum
+  void ReleaseAllBut(const SIZE_T blocknum);
+  void ReleaseAll();
+};
+
+
+// How many counters TreeGate spreads its shared holders over
+#define TREEGATE_SLOTS 64
+
+//
+// A reader/writer lock on the whole index whose shared side scales:
+// each thread counts itself in on a counter of its own (one of
+// TREEGATE_SLOTS, each on a cache line of its own) rather than on one
+// they all share.  Taking it exclusively closes the gate and waits
+// for every counter to drain, so it is slow, and meant for the calls
+// that are rare next to lookups.
+//
+class TreeGate {
+ private:
+  struct Slot {
+    atomic<int> holders;
+    char        pad[64-sizeof(atomic<int>)];
+  };
+  Slot         slots[TREEGATE_SLOTS];
+  atomic<bool> closed;
+  mutex        writers;
+
+  static SIZE_T MySlot();
+
+  TreeGate(const TreeGate &rhs);
+  TreeGate & operator=(const TreeGate &rhs);
+ public:
+  TreeGate();
+
+  void lock_shared();
+  void unlock_shared();
+  void lock();
+  void unlock();
+};
+
+
+//
+// The whole index for one operation, exclusively for those that do
+// not latch nodes (deletes, batches, scans, ...) and shared for those
+// that do.  Does nothing unless on.
+//
+class TreeLock {
+ private:
+  TreeGate *m;
+  bool      shared;
+
+  TreeLock(const TreeLock &rhs);
+  TreeLock & operator=(const TreeLock &rhs);
+ public:
+  TreeLock(TreeGate &m, const bool on, const bool shared=false);
+  ~TreeLock();
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "btree_layout.h"
+
+
+// Shapes we build specialized code for ahead of time
+template struct FixedNodeLayout<8,8>;
+template struct FixedNodeLayout<16,16>;
+template struct FixedNodeLayout<8,64>;
+template struct FixedKeyLayout<8>;
+template struct FixedKeyLayout<16>;
+
+
+static SIZE_T GenericLowerBound(const BTreeNodeView &b, const KEY_T &k)
+{
+  return b.LowerBound(k);
+}
+
+static int GenericCompareKey(const BTreeNodeView &b, const SIZE_T offset, const KEY_T &k)
+{
+  return b.CompareKey(offset,k);
+}
+
+static const BTreeNodeOps GenericNodeOps = {
+  0,
+  0,
+  GenericLowerBound,
+  GenericCompareKey
+};
+
+
+const BTreeNodeOps *GetBTreeNodeOps(const SIZE_T keysize, const SIZE_T valuesize)
+{
+  static const BTreeNodeOps *specialized[] = {
+    &FixedNodeLayout<8,8>::ops,
+    &FixedNodeLayout<16,16>::ops,
+    &FixedNodeLayout<8,64>::ops
+  };
+
+  for (SIZE_T i=0;i<sizeof(specialized)/sizeof(specialized[0]);i++) { 
+    if (specialized[i]->keysize==keysize && specialized[i]->valuesize==valuesize) { 
+      return specialized[i];
+    }
+  }
+  // Failing that, keys the kernels handle (integer keys among them)
+  // still get fixed-length compares
+  if (keysize==8) { 
+    return &FixedKeyLayout<8>::ops;
+  }
+  if (keysize==16) { 
+    return &FixedKeyLayout<16>::ops;
+  }
+  return &GenericNodeOps;
+}
@@ -0,0 +1,195 @@
+#ifndef _btree_layout
+#define _btree_layout
+
+#include <string.h>
+
+#include "global.h"
+#include "btree_ds.h"
+#include "keysearch.h"
+
+//
+// Node search specialized at compile time for one key and value size.
+//
+// BTreeNodeView works for any key and value size, so every slot
+// address is a multiplication by a runtime size and every compare a
+// memcmp of runtime length.  FixedNodeLayout<KEYSIZE,VALUESIZE> fixes
+// both, so slot strides and offsets are compile-time constants and the
+// key compare is a fixed-length memcmp that the compiler inlines.
+//
+// BTreeIndex does not use these directly.  It picks a BTreeNodeOps
+// table at Attach, from the key and value sizes in the superblock,
+// and calls through that.  So only the search within a node and key
+// compares are specialized: the descent around them, and inserting
+// into, moving and splitting slots, are BTreeNodeView's as before,
+// and each node searched costs an indirect call that cannot inline.
+// btree_searchbench times a node search through the table and
+// inlined, to show what that call costs against what it saves.
+//
+// The common shapes are instantiated in btree_layout.cc.  Other
+// shapes with 8 or 16 byte keys get a FixedKeyLayout, and the rest
+// the generic table, which just calls BTreeNodeView.  Only
+// BTREE_FORMAT_CLASSIC nodes and split (BTREE_FORMAT_SOA) interior
+// nodes have these layouts, so nodes in other formats also go to
+// BTreeNodeView.
+//
+
+struct BTreeNodeOps {
+  SIZE_T keysize;     // zero for the generic table
+  SIZE_T valuesize;   // zero if any value size
+
+  // Same contracts as the BTreeNodeView methods of the same names
+  SIZE_T (*LowerBound)(const BTreeNodeView &b, const KEY_T &k);
+  int    (*CompareKey)(const BTreeNodeView &b, const SIZE_T offset, const KEY_T &k);
+};
+
+
+// Never returns 0; falls back to the generic table
+const BTreeNodeOps *GetBTreeNodeOps(const SIZE_T keysize, const SIZE_T valuesize);
+
+
+// memcmp order of two keys of this size.  An 8 byte key is one
+// big-endian load on each side, which is what integer keys rely on.
+template <SIZE_T KEYSIZE>
+inline bool KeyLess(const char *a, const char *b)
+{
+  return memcmp(a,b,KEYSIZE)<0;
+}
+
+template <>
+inline bool KeyLess<8>(const char *a, const char *b)
+{
+  unsigned long long x, y;
+  memcpy(&x,a,8);
+  memcpy(&y,b,8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap64(x);
+  y=__builtin_bswap64(y);
+#endif
+  return x<y;
+}
+
+
+template <SIZE_T KEYSIZE, SIZE_T VALUESIZE>
+struct FixedNodeLayout {
+  // Offsets into the data area of a node, after its NodeMetadata
+  static const SIZE_T FIRST_SLOT = sizeof(SIZE_T);
+  static const SIZE_T LEAF_SLOT_SIZE = KEYSIZE+VALUESIZE;
+  static const SIZE_T INTERIOR_SLOT_SIZE = KEYSIZE+sizeof(SIZE_T);
+
+  template <SIZE_T STRIDE>
+  static SIZE_T Search(const char *first, SIZE_T n, const char *probe)
+  {
+    static const KeySearchFn kernel=GetKeySearchKernel(KEYSIZE);
+    SIZE_T window = kernel ? KEYSEARCH_LINEAR_WINDOW : 1;
+    SIZE_T base=0;
+
+    while (n>window) {
+      SIZE_T half=n/2;
+      base = KeyLess<KEYSIZE>(first+(base+half)*STRIDE,probe) ? base+half : base;
+      n-=half;
+    }
+    if (kernel) {
+      return base + kernel(first+base*STRIDE,STRIDE,n,probe);
+    }
+    return base + (KeyLess<KEYSIZE>(first+base*STRIDE,probe) ? 1 : 0);
+  }
+
+  static SIZE_T LowerBound(const BTreeNodeView &b, const KEY_T &k)
+  {
+    // Split interior nodes keep their keys packed at the start
+    if (b.info.numkeys>0 && k.length>=KEYSIZE && b.info.format==BTREE_FORMAT_SOA) {
+      return Search<KEYSIZE>(b.data,b.info.numkeys,(const char *)k.data);
+    }
+    // Short probes need zero padding and compressed nodes another
+    // layout; leave those to the generic code
+    if (b.info.numkeys==0 || k.length<KEYSIZE || b.info.format!=BTREE_FORMAT_CLASSIC) {
+      return b.LowerBound(k);
+    }
+    const char *first=b.data+FIRST_SLOT;
+    const char *probe=(const char *)k.data;
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      return Search<LEAF_SLOT_SIZE>(first,b.info.numkeys,probe);
+    } else {
+      return Search<INTERIOR_SLOT_SIZE>(first,b.info.numkeys,probe);
+    }
+  }
+
+  static int CompareKey(const BTreeNodeView &b, const SIZE_T offset, const KEY_T &k)
+  {
+    if (k.length>=KEYSIZE && b.info.format==BTREE_FORMAT_SOA) {
+      return memcmp(b.data+offset*KEYSIZE,k.data,KEYSIZE);
+    }
+    if (k.length<KEYSIZE || b.info.format!=BTREE_FORMAT_CLASSIC) {
+      return b.CompareKey(offset,k);
+    }
+    SIZE_T stride = b.info.nodetype==BTREE_LEAF_NODE ? LEAF_SLOT_SIZE : INTERIOR_SLOT_SIZE;
+    return memcmp(b.data+FIRST_SLOT+offset*stride,k.data,KEYSIZE);
+  }
+
+  static const BTreeNodeOps ops;
+};
+
+
+template <SIZE_T KEYSIZE, SIZE_T VALUESIZE>
+const BTreeNodeOps FixedNodeLayout<KEYSIZE,VALUESIZE>::ops = {
+  KEYSIZE,
+  VALUESIZE,
+  FixedNodeLayout<KEYSIZE,VALUESIZE>::LowerBound,
+  FixedNodeLayout<KEYSIZE,VALUESIZE>::CompareKey
+};
+
+
+//
+// Only the key size fixed, for value sizes without a FixedNodeLayout.
+// Slot strides come from the node; key compares are still fixed
+// length, and for 8 byte keys a single load and compare.
+//
+template <SIZE_T KEYSIZE>
+struct FixedKeyLayout {
+  static SIZE_T LowerBound(const BTreeNodeView &b, const KEY_T &k)
+  {
+    static const KeySearchFn kernel=GetKeySearchKernel(KEYSIZE);
+
+    if (b.info.numkeys==0 || k.length<KEYSIZE ||
+	(b.info.format!=BTREE_FORMAT_CLASSIC && b.info.format!=BTREE_FORMAT_SOA)) {
+      return b.LowerBound(k);
+    }
+    const char *first=b.ResolveKey(0);
+    const char *probe=(const char *)k.data;
+    SIZE_T stride=b.GetKeyStride();
+    SIZE_T window = kernel ? KEYSEARCH_LINEAR_WINDOW : 1;
+    SIZE_T base=0, n=b.info.numkeys;
+
+    while (n>window) {
+      SIZE_T half=n/2;
+      base = KeyLess<KEYSIZE>(first+(base+half)*stride,probe) ? base+half : base;
+      n-=half;
+    }
+    if (kernel) {
+      return base + kernel(first+base*stride,stride,n,probe);
+    }
+    return base + (KeyLess<KEYSIZE>(first+base*stride,probe) ? 1 : 0);
+  }
+
+  static int CompareKey(const BTreeNodeView &b, const SIZE_T offset, const KEY_T &k)
+  {
+    if (k.length<KEYSIZE ||
+	(b.info.format!=BTREE_FORMAT_CLASSIC && b.info.format!=BTREE_FORMAT_SOA)) {
+      return b.CompareKey(offset,k);
+    }
+    return memcmp(b.ResolveKey(offset),k.data,KEYSIZE);
+  }
+
+  static const BTreeNodeOps ops;
+};
+
+
+template <SIZE_T KEYSIZE>
+const BTreeNodeOps FixedKeyLayout<KEYSIZE>::ops = {
+  KEYSIZE,
+  0,
+  FixedKeyLayout<KEYSIZE>::LowerBound,
+  FixedKeyLayout<KEYSIZE>::CompareKey
+};
+
+#endif
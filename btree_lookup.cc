@@ -28,6 +28,7 @@ int main(int argc, char **argv)
   BTreeIndex btree(0,0,&cache);
   
   ERROR_T rc;
+  KEY_T k;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) { 
@@ -41,7 +42,7 @@ int main(int argc, char **argv)
   } else {
     cerr << "Index attached!"<<endl;
     VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
+    if ((rc=btree.ParseKey(key,k)) || (rc=btree.Lookup(k,val))!=ERROR_NOERROR) { 
       cerr <<"Lookup failed: error "<<rc<<endl;
     } else {
       cerr <<"Lookup succeeded\n";
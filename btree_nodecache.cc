@@ -0,0 +1,278 @@
+#include <string.h>
+
+#include "btree_nodecache.h"
+
+
+BTreeNodeCache::BTreeNodeCache()
+  : cache(0), listening(false), keysize(0), capacity(0), maxkeys(0), kernel(0)
+{}
+
+
+BTreeNodeCache::BTreeNodeCache(const BTreeNodeCache &rhs)
+  : cache(rhs.cache), listening(false), keysize(rhs.keysize), capacity(0), maxkeys(0),
+    kernel(rhs.kernel)
+{}
+
+
+BTreeNodeCache::~BTreeNodeCache()
+{
+  // Also drops a registration left behind by an object overwritten
+  // in place (see BTreeIndex::operator=)
+  if (cache) { 
+    cache->RemoveWriteListener(Invalidate,this);
+  }
+}
+
+
+void BTreeNodeCache::Attach(BufferCache *c, const SIZE_T ks, const SIZE_T cap)
+{
+  Detach();
+  {
+    lock_guard<mutex> hold(lock);
+    cache=c;
+    keysize=ks;
+    capacity=cap;
+    kernel=GetKeySearchKernel(keysize);
+    // Every pointer in a node takes at least a SIZE_T, whatever its keys
+    maxkeys=cache->GetBlockSize()/sizeof(SIZE_T);
+    listening=true;
+    Reset();
+  }
+  // Outside the lock: the buffer cache calls Invalidate with its own
+  // lock held, so that one is always taken first
+  cache->AddWriteListener(Invalidate,this);
+}
+
+
+void BTreeNodeCache::Detach()
+{
+  if (cache) { 
+    cache->RemoveWriteListener(Invalidate,this);
+  }
+  lock_guard<mutex> hold(lock);
+  listening=false;
+  slots.clear();
+  index.clear();
+}
+
+
+// Slots are only ever made or done away with here, while nobody is
+// searching, so a search never sees one move
+void BTreeNodeCache::SetCapacity(const SIZE_T cap)
+{
+  lock_guard<mutex> hold(lock);
+  capacity=cap;
+  Reset();
+}
+
+
+void BTreeNodeCache::Reset()
+{
+  slots=vector<DecodedNode>(listening ? capacity : 0);
+  for (SIZE_T i=0;i<slots.size();i++) { 
+    slots[i].keys.assign(maxkeys*keysize,0);
+    slots[i].ptrs=vector<atomic<SIZE_T> >(maxkeys+1);
+    slots[i].high.assign(keysize,0);
+  }
+  index=vector<atomic<SIZE_T> >(listening && capacity ? cache->GetNumBlocks() : 0);
+}
+
+
+// Searches that were going through the slot see its sequence number
+// change, and give up on it
+void BTreeNodeCache::Drop(DecodedNode &d)
+{
+  unsigned seq=d.seq.load(memory_order_relaxed);
+
+  d.seq.store(seq+1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  index[d.blocknum.load(memory_order_relaxed)].store(0,memory_order_relaxed);
+  d.blocknum.store(0,memory_order_relaxed);
+  d.seq.store(seq+2,memory_order_release);
+}
+
+
+void BTreeNodeCache::Invalidate(const SIZE_T blocknum, void *arg)
+{
+  BTreeNodeCache *c=(BTreeNodeCache *)arg;
+  lock_guard<mutex> hold(c->lock);
+
+  if (blocknum<c->index.size()) { 
+    SIZE_T slot=c->index[blocknum].load(memory_order_relaxed);
+    if (slot) { 
+      c->Drop(c->slots[slot-1]);
+    }
+  }
+}
+
+
+bool BTreeNodeCache::Find(const SIZE_T blocknum, const KEY_T &k, SIZE_T &child,
+			  KEY_T *bound, bool *bounded, bool *across,
+			  VERSION_T *version) const
+{
+  if (blocknum>=index.size()) { 
+    return false;
+  }
+  SIZE_T slot=index[blocknum].load(memory_order_acquire);
+  if (!slot) { 
+    return false;
+  }
+  const DecodedNode &d=slots[slot-1];
+  unsigned seq=d.seq.load(memory_order_acquire);
+  if ((seq & 1) || d.blocknum.load(memory_order_relaxed)!=blocknum) { 
+    return false;
+  }
+  // Anything read from here on may be torn, until the sequence number
+  // is seen not to have moved; numkeys is kept in bounds so the search
+  // at least stays inside the slot
+  SIZE_T numkeys=d.numkeys.load(memory_order_relaxed);
+  if (numkeys>maxkeys) { 
+    return false;
+  }
+  bool right = across && d.highkey.load(memory_order_relaxed) && CompareKey(&d.high[0],k)<0;
+  SIZE_T offset = right ? 0 : LowerBound(d,numkeys,k);
+  SIZE_T c = right ? d.right.load(memory_order_relaxed) : d.ptrs[offset].load(memory_order_relaxed);
+  KEY_T b;
+  if (bound && !right && offset<numkeys) { 
+    GetKey(d,offset,b);
+  }
+  VERSION_T v=d.version.load(memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+  if (d.seq.load(memory_order_relaxed)!=seq) { 
+    return false;
+  }
+  if (bound && !right && offset<numkeys) { 
+    *bound=b;
+    *bounded=true;
+  }
+  if (across) { 
+    *across=right;
+  }
+  if (version) { 
+    *version=v;
+  }
+  child=c;
+  return true;
+}
+
+
+void BTreeNodeCache::Insert(const SIZE_T blocknum, const BTreeNodeView &b,
+			    const SIZE_T depth, const VERSION_T version)
+{
+  KEY_T k;
+  SIZE_T i, ptr;
+
+  lock_guard<mutex> hold(lock);
+
+  if (!listening || capacity==0 || b.info.numkeys==0 || b.info.numkeys>maxkeys ||
+      blocknum>=index.size() || index[blocknum].load(memory_order_relaxed)) { 
+    return;
+  }
+
+  // A free slot, or failing that the deepest copy, if this node is
+  // higher up
+  DecodedNode *d=0;
+  DecodedNode *deepest=0;
+  for (i=0;i<slots.size();i++) { 
+    if (slots[i].blocknum.load(memory_order_relaxed)==0) { 
+      d=&slots[i];
+      break;
+    }
+    if (!deepest || slots[i].depth>deepest->depth) { 
+      deepest=&slots[i];
+    }
+  }
+  if (!d) { 
+    if (depth>=deepest->depth) { 
+      return;
+    }
+    Drop(*deepest);
+    d=deepest;
+  }
+
+  unsigned seq=d->seq.load(memory_order_relaxed);
+  d->seq.store(seq+1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  d->depth=depth;
+  d->numkeys.store(b.info.numkeys,memory_order_relaxed);
+  memset(&d->keys[0],0,b.info.numkeys*keysize);
+  for (i=0;i<b.info.numkeys;i++) { 
+    if (b.GetKey(i,k) || b.GetPtr(i,ptr)) { 
+      d->seq.store(seq+2,memory_order_release);
+      return;
+    }
+    memcpy(&d->keys[i*keysize],k.data,k.length<keysize ? k.length : keysize);
+    d->ptrs[i].store(ptr,memory_order_relaxed);
+  }
+  if (b.GetPtr(b.info.numkeys,ptr)) { 
+    d->seq.store(seq+2,memory_order_release);
+    return;
+  }
+  d->ptrs[b.info.numkeys].store(ptr,memory_order_relaxed);
+  d->highkey.store(b.HasHighKey(),memory_order_relaxed);
+  if (b.HasHighKey()) { 
+    if (b.GetHighKey(k)) { 
+      d->highkey.store(false,memory_order_relaxed);
+      d->seq.store(seq+2,memory_order_release);
+      return;
+    }
+    memset(&d->high[0],0,keysize);
+    memcpy(&d->high[0],k.data,k.length<keysize ? k.length : keysize);
+  }
+  d->right.store(b.GetRightSibling(),memory_order_relaxed);
+  d->version.store(version,memory_order_relaxed);
+  d->blocknum.store(blocknum,memory_order_relaxed);
+  d->seq.store(seq+2,memory_order_release);
+  index[blocknum].store((d-&slots[0])+1,memory_order_release);
+}
+
+
+void BTreeNodeCache::Forget(const SIZE_T blocknum)
+{
+  Invalidate(blocknum,this);
+}
+
+
+// memcmp order, the shorter side padded with zeros
+int BTreeNodeCache::CompareKey(const char *stored, const KEY_T &k) const
+{
+  SIZE_T n = k.length<keysize ? k.length : keysize;
+  int c=memcmp(stored,k.data,n);
+
+  if (c) { 
+    return c;
+  }
+  for (;n<keysize;n++) { 
+    if (stored[n]) { 
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+SIZE_T BTreeNodeCache::LowerBound(const DecodedNode &d, const SIZE_T numkeys,
+				  const KEY_T &k) const
+{
+  const char *first=&d.keys[0];
+  SIZE_T base=0, n=numkeys;
+  SIZE_T window = kernel && k.length>=keysize ? KEYSEARCH_LINEAR_WINDOW : 1;
+
+  while (n>window) { 
+    SIZE_T half=n/2;
+    base = CompareKey(first+(base+half)*keysize,k)<0 ? base+half : base;
+    n-=half;
+  }
+  if (window>1) { 
+    return base + kernel(first+base*keysize,keysize,n,(const char *)k.data);
+  }
+  return base + (n>0 && CompareKey(first+base*keysize,k)<0 ? 1 : 0);
+}
+
+
+void BTreeNodeCache::GetKey(const DecodedNode &d, const SIZE_T offset, KEY_T &k) const
+{
+  k=KEY_T(keysize);
+  memcpy(k.data,&d.keys[offset*keysize],keysize);
+}
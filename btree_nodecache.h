@@ -0,0 +1,123 @@
+#ifndef _btree_nodecache
+#define _btree_nodecache
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include "global.h"
+#include "buffercache.h"
+#include "btree_ds.h"
+#include "keysearch.h"
+#include "btree_latch.h"
+
+using namespace std;
+
+//
+// Decoded copies of interior nodes, kept by BTreeIndex so that going
+// down through the upper levels of the tree costs only key compares:
+// no pin, no lookup in the buffer cache, and no decoding of
+// prefix-compressed or slotted nodes.
+//
+// A copy has all its keys at full size, zero padded and one after the
+// other, and its pointers apart, whatever the format of the node.  The
+// cache listens for writes to blocks (BufferCache::AddWriteListener)
+// and drops the copy of any block written or deallocated, so a copy is
+// never stale unless it was made from a node read without a latch and
+// went in after the write; such a copy carries the version the node
+// was read at, which the reader checks.  When it is full it makes room for a node by dropping
+// one further down the tree, if it has one, so the top levels stay.
+//
+// Thread safe.  Copies are searched in place and never handed out.
+// Searches take no lock and write nothing shared, so threads going
+// down the same top levels do not slow each other: each copy has a
+// sequence number that is odd while it is being changed, and a search
+// that finds it changed under it counts as a miss.  Changes to the
+// copies take the cache's lock.  A node can still change the moment a
+// search of its copy is done, so a caller that needs the answer to
+// hold until it has gone on down latches the node, or checks its
+// version afterwards (see btree_latch.h).
+//
+
+// How many nodes an index keeps decoded unless told otherwise
+#define BTREE_NODECACHE_SIZE 64
+
+// A slot for one copy, with room for the most keys a block can hold
+struct DecodedNode {
+  atomic<unsigned> seq;      // odd while the slot is being changed
+  atomic<SIZE_T>   blocknum; // 0 if the slot is free
+  SIZE_T           depth;    // levels below the root
+  atomic<SIZE_T>   numkeys;
+  vector<char>     keys;     // numkeys keys of keysize bytes each
+  vector<atomic<SIZE_T> > ptrs;  // numkeys+1 pointers
+  // B-link indexes: the high key, zero padded, if highkey is set, and
+  // the node to the right
+  atomic<bool>     highkey;
+  vector<char>     high;
+  atomic<SIZE_T>   right;
+  atomic<VERSION_T> version; // the node's, as Insert was given it
+
+  DecodedNode() : seq(0), blocknum(0), depth(0), numkeys(0), highkey(false), right(0), version(0) {}
+};
+
+
+class BTreeNodeCache {
+ private:
+  BufferCache *cache;
+  bool         listening;
+  SIZE_T       keysize;
+  SIZE_T       capacity;
+  SIZE_T       maxkeys;    // the most keys a slot has room for
+  KeySearchFn  kernel;
+  vector<DecodedNode> slots;
+  // For each block of the disk, its slot plus one, or 0
+  vector<atomic<SIZE_T> > index;
+  // Held for any change to slots or index
+  mutex        lock;
+
+  static void Invalidate(const SIZE_T blocknum, void *arg);
+  // Makes room for capacity copies and empties the index; lock held
+  void   Reset();
+  // Frees the slot; lock held
+  void   Drop(DecodedNode &d);
+  int  CompareKey(const char *stored, const KEY_T &k) const;
+  // As BTreeNodeView::LowerBound, over the first numkeys keys
+  SIZE_T LowerBound(const DecodedNode &d, const SIZE_T numkeys, const KEY_T &k) const;
+  // The ith key, zero padded to keysize
+  void   GetKey(const DecodedNode &d, const SIZE_T offset, KEY_T &k) const;
+
+  BTreeNodeCache & operator=(const BTreeNodeCache &rhs);
+ public:
+  BTreeNodeCache();
+  // A copy starts out empty, and keeps nothing
+  BTreeNodeCache(const BTreeNodeCache &rhs);
+  ~BTreeNodeCache();
+
+  // Keeps up to capacity nodes of keysize byte keys, stored in blocks
+  // of cache, until Detach
+  void   Attach(BufferCache *cache, const SIZE_T keysize, const SIZE_T capacity);
+  void   Detach();
+  void   SetCapacity(const SIZE_T capacity);
+
+  // False unless this block has a copy, and it did not change while
+  // it was being searched.  If it does, child is the pointer to follow
+  // for k, as BTreeNodeView::LowerBound picks it, and if there is a
+  // key to the right of that pointer and bound is given, *bound is
+  // that key (zero padded to keysize) and *bounded is set.  If across
+  // is given and k is past the node's high key (see BTreeNodeView::
+  // IsPastHighKey), child is the node to the right instead, and
+  // *across is set.  If version is given, *version is the version the
+  // copy was kept with.
+  bool   Find(const SIZE_T blocknum, const KEY_T &k, SIZE_T &child,
+	      KEY_T *bound=0, bool *bounded=0, bool *across=0,
+	      VERSION_T *version=0) const;
+  // Decodes interior node b, stored in this block depth levels below
+  // the root and at this version of its latch, and keeps it if there
+  // is room.  b must not change until this returns.
+  void   Insert(const SIZE_T blocknum, const BTreeNodeView &b, const SIZE_T depth,
+		const VERSION_T version=0);
+  // Drops this block's copy, if it has one
+  void   Forget(const SIZE_T blocknum);
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_scan filestem cachesize lo hi [limit]\n";
+}
+
+
+// Writes each pair as "(key,value)" on its own line
+static ERROR_T PrintPair(const KEY_T &key, const VALUE_T &value, void *arg)
+{
+  cout << "(";
+  ((BTreeIndex *)arg)->PrintKey(cout,key);
+  cout << ",";
+  for (SIZE_T i=0; i<value.length; i++) { 
+    cout << value.data[i];
+  }
+  cout << ")\n";
+  return ERROR_NOERROR;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  SIZE_T limit=0;
+  char *lo, *hi;
+
+  if (argc!=5 && argc!=6) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  lo=argv[3];
+  hi=argv[4];
+  if (argc==6) { 
+    limit=atoi(argv[5]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+  KEY_T lokey, hikey;
+
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.ParseKey(lo,lokey)) || (rc=btree.ParseKey(hi,hikey)) ||
+	(rc=btree.Scan(lokey,hikey,limit,PrintPair,&btree))!=ERROR_NOERROR) { 
+      cerr <<"Scan failed: error "<<rc<<endl;
+    } else {
+      cerr <<"Scan succeeded\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "btree.h"
+#include "keysearch.h"
+
+void usage()
+{
+  cerr << "usage: btree_searchbench keysize(8|16) numprobes\n";
+}
+
+//
+// Microbenchmark for in-node key search.  For each node size and type
+// (and split interior nodes, whose keys are packed together), fills a node with sorted keys and times lower bound probes done with
+// one memcmp per slot (linear and binary) and with binary search
+// finished off by each key search kernel this CPU can run.  Then the
+// whole of node search as BTreeIndex does it: BTreeNodeView's own,
+// the FixedNodeLayout for the key size called through the
+// BTreeNodeOps table as BTreeIndex calls it, and the same called
+// directly so that it inlines into the loop; the last two differ by
+// what the indirect call costs.  Rounds are repeated and the best
+// time of each kept.  The default build has no optimization; build with
+// make CXXFLAGS=-O2 for numbers that mean anything.
+//
+
+// Each time is the best of this many
+#define SEARCHBENCH_ROUNDS 5
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec*1e9+t.tv_nsec;
+}
+
+// Big-endian, so that memcmp order is numeric order
+static void EncodeKey(char *p, const SIZE_T keysize, unsigned long long x)
+{
+  memset(p,0,keysize);
+  for (int i=7;i>=0;i--) {
+    p[keysize-8+i]=(char)(x&0xff);
+    x>>=8;
+  }
+}
+
+static SIZE_T LinearMemcmp(const BTreeNode &b, const KEY_T &k)
+{
+  SIZE_T i;
+  for (i=0;i<b.info.numkeys;i++) {
+    if (memcmp(b.ResolveKey(i),k.data,b.info.keysize)>=0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static SIZE_T BinaryMemcmp(const BTreeNode &b, const KEY_T &k)
+{
+  SIZE_T lo=0, hi=b.info.numkeys;
+  while (lo<hi) {
+    SIZE_T mid=(lo+hi)/2;
+    if (memcmp(b.ResolveKey(mid),k.data,b.info.keysize)<0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+static SIZE_T BinaryKernel(const BTreeNode &b, const KEY_T &k, KeySearchFn kernel)
+{
+  const char *first=b.ResolveKey(0);
+  SIZE_T stride=b.ResolveKey(1)-first;
+  SIZE_T base=0, n=b.info.numkeys;
+
+  while (n>KEYSEARCH_LINEAR_WINDOW) {
+    SIZE_T half=n/2;
+    base = memcmp(first+(base+half)*stride,k.data,b.info.keysize)<0 ? base+half : base;
+    n-=half;
+  }
+  return base+kernel(first+base*stride,stride,n,(const char *)k.data);
+}
+
+// Sum of lower bounds of all the probes, with the layout known here
+template <SIZE_T KEYSIZE>
+static SIZE_T InlineProbes(const BTreeNodeView &b, const vector<KEY_T> &probes)
+{
+  SIZE_T sum=0;
+  for (SIZE_T p=0;p<probes.size();p++) {
+    sum+=FixedNodeLayout<KEYSIZE,KEYSIZE>::LowerBound(b,probes[p]);
+  }
+  return sum;
+}
+
+
+int main(int argc, char **argv)
+{
+  SIZE_T keysize, numprobes;
+  SIZE_T blocksizes[] = {512, 1024, 4096, 16384};
+  int nodetypes[] = {BTREE_LEAF_NODE, BTREE_INTERIOR_NODE, BTREE_INTERIOR_NODE};
+  SIZE_T formats[] = {BTREE_FORMAT_CLASSIC, BTREE_FORMAT_CLASSIC, BTREE_FORMAT_SOA};
+  KeySearchImpl impls[] = {KEYSEARCH_SCALAR, KEYSEARCH_SSE42, KEYSEARCH_AVX2};
+
+  if (argc!=3) {
+    usage();
+    return -1;
+  }
+
+  keysize=atoi(argv[1]);
+  numprobes=atoi(argv[2]);
+
+  if ((keysize!=8 && keysize!=16) || numprobes==0) {
+    usage();
+    return -1;
+  }
+
+  cout << "ns per probe, keysize="<<keysize<<", best kernel is "
+       << KeySearchImplName(GetBestKeySearchImpl(keysize))<<endl;
+  cout << "blocksize\tnode\tslots\tlinear\tbinary";
+  for (SIZE_T j=0;j<sizeof(impls)/sizeof(impls[0]);j++) {
+    cout << "\t" << KeySearchImplName(impls[j]);
+  }
+  cout << "\tview\ttable\tinline" << endl;
+
+  srand(339);
+
+  for (SIZE_T i=0;i<sizeof(blocksizes)/sizeof(blocksizes[0]);i++) {
+    for (SIZE_T t=0;t<sizeof(nodetypes)/sizeof(nodetypes[0]);t++) {
+      BTreeNode b(nodetypes[t],keysize,keysize,blocksizes[i]);
+      b.View().Clear(formats[t]);
+      b.info.numkeys = nodetypes[t]==BTREE_LEAF_NODE ?
+	b.info.GetNumSlotsAsLeaf() : b.info.GetNumSlotsAsInterior();
+      for (SIZE_T s=0;s<b.info.numkeys;s++) {
+	EncodeKey(b.ResolveKey(s),keysize,(s+1)*1000);
+      }
+
+      vector<KEY_T> probes(numprobes,KEY_T(keysize));
+      for (SIZE_T p=0;p<numprobes;p++) {
+	EncodeKey((char *)probes[p].data,keysize,rand()%((b.info.numkeys+1)*1000));
+      }
+
+      // The best of several rounds, each column taking its turn in
+      // each, so that a spell of noise on the machine does not land
+      // on one column
+      SIZE_T numimpls=sizeof(impls)/sizeof(impls[0]);
+      vector<double> best(2+numimpls+3,-1);
+      BTreeNodeView view=b.View();
+      const BTreeNodeOps *ops=GetBTreeNodeOps(keysize,keysize);
+      SIZE_T check=0;
+      double start, elapsed;
+
+      for (SIZE_T round=0;round<SEARCHBENCH_ROUNDS;round++) {
+	start=Now();
+	for (SIZE_T p=0;p<numprobes;p++) {
+	  check+=LinearMemcmp(b,probes[p]);
+	}
+	elapsed=(Now()-start)/numprobes;
+	best[0] = best[0]<0 || elapsed<best[0] ? elapsed : best[0];
+
+	start=Now();
+	for (SIZE_T p=0;p<numprobes;p++) {
+	  check-=BinaryMemcmp(b,probes[p]);
+	}
+	elapsed=(Now()-start)/numprobes;
+	best[1] = best[1]<0 || elapsed<best[1] ? elapsed : best[1];
+
+	for (SIZE_T j=0;j<numimpls;j++) {
+	  KeySearchFn kernel=GetKeySearchKernel(keysize,impls[j]);
+	  if (!kernel) {
+	    continue;
+	  }
+	  start=Now();
+	  for (SIZE_T p=0;p<numprobes;p++) {
+	    check+=BinaryKernel(b,probes[p],kernel);
+	  }
+	  elapsed=(Now()-start)/numprobes;
+	  best[2+j] = best[2+j]<0 || elapsed<best[2+j] ? elapsed : best[2+j];
+	  for (SIZE_T p=0;p<numprobes;p++) {
+	    check-=BinaryMemcmp(b,probes[p]);
+	  }
+	}
+
+	for (SIZE_T j=0;j<3;j++) {
+	  start=Now();
+	  if (j==0) {
+	    for (SIZE_T p=0;p<numprobes;p++) {
+	      check+=view.LowerBound(probes[p]);
+	    }
+	  } else if (j==1) {
+	    for (SIZE_T p=0;p<numprobes;p++) {
+	      check+=ops->LowerBound(view,probes[p]);
+	    }
+	  } else {
+	    check+= keysize==8 ? InlineProbes<8>(view,probes) : InlineProbes<16>(view,probes);
+	  }
+	  elapsed=(Now()-start)/numprobes;
+	  best[2+numimpls+j] = best[2+numimpls+j]<0 || elapsed<best[2+numimpls+j] ? elapsed : best[2+numimpls+j];
+	  for (SIZE_T p=0;p<numprobes;p++) {
+	    check-=BinaryMemcmp(b,probes[p]);
+	  }
+	}
+      }
+
+      cout << blocksizes[i] << "\t" << (nodetypes[t]==BTREE_LEAF_NODE ? "leaf" :
+					formats[t]==BTREE_FORMAT_SOA ? "soa" : "interior")
+	   << "\t" << b.info.numkeys;
+      for (SIZE_T j=0;j<best.size();j++) {
+	if (best[j]<0) {
+	  cout << "\t-";
+	} else {
+	  cout << "\t" << best[j];
+	}
+      }
+      cout << endl;
+
+      if (check!=0) {
+	cerr << "Kernels disagree with memcmp search!\n";
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include "btree.h"
+
+void usage()
+{
+  cerr << "usage: btree_stress filestem cachesize threads keysperthread [OPTIMISTIC] [option ...]\n";
+  cerr << "       OPTIMISTIC uses optimistic lock coupling; options are as for\n";
+  cerr << "       btree_init.  With neither given, the index is made and stressed\n";
+  cerr << "       once plain and once with each option, each way\n";
+}
+
+//
+// Stress test for concurrent mode (see BTreeIndex::SetConcurrent).
+// Makes an index of 8 byte keys and values on the disk, then has
+// each thread insert its own keys in a random order, looking up and
+// updating ones it has already inserted and looking up others' as it
+// goes.  Thread t's keys are t, t+threads, t+2*threads, ..., so all
+// threads insert into the same leaves at once, and under optimistic
+// lock coupling keep finding that a node they went through has changed
+// and starting again.  As many threads again only look keys up, so
+// there are always descents under way while nodes split, and in a
+// BTREE_OPT_BLINK index they have to move right past the new halves.
+// Once the inserting threads are done, checks the index is sane and
+// that every key is there with one of the values it was given.  The
+// buffer cache should be small enough, and there should be enough
+// keys for the blocks, that interior nodes split too (512 byte blocks
+// and 20000 keys make three levels) and blocks are written out while
+// the threads run.
+//
+
+static BTreeIndex *btree;
+static SIZE_T numthreads, keysperthread;
+static atomic<SIZE_T> failures;
+// Set once every inserting thread is done
+static atomic<bool> inserted;
+
+// Key k as text, which is also the value it is inserted with
+static void KeyText(char *buf, const SIZE_T k)
+{
+  snprintf(buf,9,"%08u",(unsigned)k);
+}
+
+// Whether value is what the key text was inserted or updated with
+static bool GoodValue(const VALUE_T &value, const char *text)
+{
+  return value.length==8 &&
+    (value.data[0]==text[0] || value.data[0]=='u') &&
+    !memcmp(value.data+1,text+1,7);
+}
+
+static void Fail(const char *what, const char *text, const ERROR_T rc)
+{
+  cerr << what << " of " << text << " failed: error " << rc << endl;
+  failures++;
+}
+
+static void Worker(const SIZE_T t)
+{
+  mt19937 rng(t*7+1);
+  vector<SIZE_T> keys;
+  char text[16], newtext[16];
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  for (SIZE_T i=0; i<keysperthread; i++) {
+    keys.push_back(i*numthreads+t);
+  }
+  shuffle(keys.begin(),keys.end(),rng);
+
+  for (SIZE_T i=0; i<keysperthread; i++) {
+    KeyText(text,keys[i]);
+    if ((rc=btree->ParseKey(text,key)) || (rc=btree->Insert(key,VALUE_T(text)))) {
+      Fail("insert",text,rc);
+    }
+    // One of our own, which has to be there
+    if (i%3==0) {
+      KeyText(text,keys[rng()%(i+1)]);
+      if ((rc=btree->ParseKey(text,key)) || (rc=btree->Lookup(key,value)) ||
+	  (rc=GoodValue(value,text) ? ERROR_NOERROR : ERROR_INSANE)) {
+	Fail("lookup",text,rc);
+      }
+    }
+    if (i%5==0) {
+      KeyText(text,keys[rng()%(i+1)]);
+      strcpy(newtext,text);
+      newtext[0]='u';
+      if ((rc=btree->ParseKey(text,key)) || (rc=btree->Update(key,VALUE_T(newtext)))) {
+	Fail("update",text,rc);
+      }
+    }
+    // Anyone's, which may not be there yet
+    if (i%2==0) {
+      KeyText(text,rng()%(keysperthread*numthreads));
+      if ((rc=btree->ParseKey(text,key))) {
+	Fail("lookup",text,rc);
+      } else if ((rc=btree->Lookup(key,value))==ERROR_NOERROR) {
+	if (!GoodValue(value,text)) {
+	  Fail("lookup",text,ERROR_INSANE);
+	}
+      } else if (rc!=ERROR_NONEXISTENT) {
+	Fail("lookup",text,rc);
+      }
+    }
+  }
+}
+
+static void Reader(const SIZE_T t)
+{
+  mt19937 rng(t*7+2);
+  char text[16];
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+
+  while (!inserted) {
+    KeyText(text,rng()%(keysperthread*numthreads));
+    if ((rc=btree->ParseKey(text,key))) {
+      Fail("lookup",text,rc);
+    } else if ((rc=btree->Lookup(key,value))==ERROR_NOERROR) {
+      if (!GoodValue(value,text)) {
+	Fail("lookup",text,ERROR_INSANE);
+      }
+    } else if (rc!=ERROR_NONEXISTENT) {
+      Fail("lookup",text,rc);
+    }
+  }
+}
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+// Makes the index with these options, runs the threads against it and
+// checks it afterwards; returns the number of failures
+static SIZE_T Stress(BufferCache &cache, const SIZE_T options, const bool optimistic)
+{
+  BTreeIndex index(8,8,&cache,true,options);
+  vector<thread> threads, readers;
+  char text[16];
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T superblocknum;
+  double start;
+  ERROR_T rc;
+
+  if ((rc=index.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return 1;
+  }
+  btree=&index;
+  failures=0;
+  inserted=false;
+
+  index.SetConcurrent(true,optimistic);
+  start=Now();
+  for (SIZE_T t=0; t<numthreads; t++) {
+    threads.push_back(thread(Worker,t));
+  }
+  for (SIZE_T t=0; t<numthreads; t++) {
+    readers.push_back(thread(Reader,t));
+  }
+  for (SIZE_T t=0; t<numthreads; t++) {
+    threads[t].join();
+  }
+  inserted=true;
+  for (SIZE_T t=0; t<numthreads; t++) {
+    readers[t].join();
+  }
+  cerr << numthreads << "+" << numthreads << " threads, " << numthreads*keysperthread << " keys: "
+       << Now()-start << " s" << endl;
+  index.SetConcurrent(false);
+
+  if ((rc=index.SanityCheck())) {
+    cerr << "Sanity check failed: error "<<rc<<endl;
+    failures++;
+  }
+  for (SIZE_T k=0; k<numthreads*keysperthread; k++) {
+    KeyText(text,k);
+    if ((rc=index.ParseKey(text,key)) || (rc=index.Lookup(key,value)) ||
+	(rc=GoodValue(value,text) ? ERROR_NOERROR : ERROR_INSANE)) {
+      Fail("final lookup",text,rc);
+    }
+  }
+
+  if ((rc=index.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    failures++;
+  }
+  return failures;
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *allopts[] = { "PREFIX", "TRUNCATE", "VARLEN", "INTKEYS", "UINTKEYS",
+			    "SOA", "LAZYDELETE", "SPLITFULL", "BSTAR", "APPENDSPLIT",
+			    "TOPDOWN", "BLINK" };
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T options=0;
+  SIZE_T failed=0;
+  bool optimistic=false;
+  int first=5;
+
+  if (argc<5) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  numthreads=atoi(argv[3]);
+  keysperthread=atoi(argv[4]);
+
+  if (argc>5 && string(argv[5])=="OPTIMISTIC") {
+    optimistic=true;
+    first++;
+  }
+  for (int i=first;i<argc;i++) {
+    if (GetIndexOption(argv[i])==0) {
+      usage();
+      return -1;
+    }
+    options|=GetIndexOption(argv[i]);
+  }
+
+  // Keys are 8 digits
+  if (numthreads==0 || keysperthread==0 || numthreads*keysperthread>100000000) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if (argc>5) {
+    failed+=Stress(cache,options,optimistic);
+  } else {
+    for (int olc=0; olc<2; olc++) {
+      cerr << (olc ? "OPTIMISTIC" : "(no options)") << endl;
+      failed+=Stress(cache,0,olc);
+      for (unsigned i=0; i<sizeof(allopts)/sizeof(allopts[0]); i++) {
+	cerr << (olc ? "OPTIMISTIC " : "") << allopts[i] << endl;
+	failed+=Stress(cache,GetIndexOption(allopts[i]),olc);
+      }
+    }
+  }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (failed) {
+    cerr << failed << " failures" << endl;
+    return -1;
+  }
+  cerr << "Stress test succeeded" << endl;
+  return 0;
+}
@@ -1,3 +1,7 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
 #include "buffercache.h"
 
 ERROR_T BufferCache::CheckDeleteOldest()
@@ -17,6 +21,10 @@ ERROR_T BufferCache::CheckDeleteOldest()
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
+       // Pinned frames are in use in place and cannot go anywhere
+       if ((*i).second.pincount>0) { 
+	 continue;
+       }
        if ((*i).second.lastaccessed<oldest) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
@@ -60,12 +68,14 @@ BufferCache::~BufferCache()
 
 ERROR_T BufferCache::Attach()
 {
+  lock_guard<recursive_mutex> hold(lock);
   blockmap.clear();
   return ERROR_NOERROR;
 }
 
 ERROR_T BufferCache::Detach()
 {
+  lock_guard<recursive_mutex> hold(lock);
   // write out all of our data and then throw it away
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
@@ -104,32 +114,55 @@ SIZE_T BufferCache::GetNumBlocks() const
   return disk->GetNumBlocks();
 }
 
+SIZE_T BufferCache::GetNumHeads() const
+{
+  return disk->GetNumHeads();
+}
+
+SIZE_T BufferCache::GetBlocksPerTrack() const
+{
+  return disk->GetBlocksPerTrack();
+}
+
 double BufferCache::GetCurrentTime() const
 {
+  lock_guard<recursive_mutex> hold(lock);
   return curtime;
 }
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  lock_guard<recursive_mutex> hold(lock);
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  lock_guard<recursive_mutex> hold(lock);
   deallocs++;
+  NotifyWrite(inblocknum);
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
 
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  lock_guard<recursive_mutex> hold(lock);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
+bool  BufferCache::IsBlockCached(const SIZE_T inblocknum) const
+{
+  lock_guard<recursive_mutex> hold(lock);
+  return blockmap.find(inblocknum)!=blockmap.end();
+}
+
+
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  lock_guard<recursive_mutex> hold(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
   b = blockmap.find(inblocknum);
@@ -169,16 +202,24 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  lock_guard<recursive_mutex> hold(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(inblocknum);
 
   if (b!=blockmap.end()) {
-    // It's in  cache, so just replace the block
-    (*b).second=inblock;
+    // It's in  cache, so just replace the block's contents in place,
+    // since someone may have it pinned
+    if ((*b).second.length==inblock.length) { 
+      memcpy((*b).second.data,inblock.data,inblock.length);
+    } else {
+      assert((*b).second.pincount==0);
+      (*b).second=inblock;
+    }
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
     writes++;
+    NotifyWrite(inblocknum);
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -193,18 +234,157 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
     myblock.dirty=true;
     blockmap[inblocknum]=myblock;
     writes++;
+    NotifyWrite(inblocknum);
     return ERROR_NOERROR;
   }
 }
   
+ERROR_T BufferCache::PinBlock(const SIZE_T inblocknum, Block *&frame)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(inblocknum);
+
+  if (b==blockmap.end()) {
+    // Bring it in the usual way, then find the frame it landed in
+    Block block;
+    ERROR_T rc=ReadBlock(inblocknum,block);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    b = blockmap.find(inblocknum);
+  } else {
+    reads++;
+  }
+
+  (*b).second.lastaccessed=curtime;
+  (*b).second.pincount++;
+  frame=&((*b).second);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnpinBlock(const SIZE_T inblocknum, const bool dirty)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(inblocknum);
+
+  if (b==blockmap.end() || (*b).second.pincount==0) { 
+    return ERROR_IMPLBUG;
+  }
+
+  (*b).second.pincount--;
+  (*b).second.lastaccessed=curtime;
+  if (dirty) { 
+    (*b).second.dirty=true;
+    writes++;
+    NotifyWrite(inblocknum);
+  }
+  return ERROR_NOERROR;
+}
+
+void BufferCache::AddWriteListener(BlockWriteFn fn, void *arg)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  listeners.push_back(make_pair(fn,arg));
+}
+
+void BufferCache::RemoveWriteListener(BlockWriteFn fn, void *arg)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  listeners.erase(remove(listeners.begin(),listeners.end(),make_pair(fn,arg)),
+		  listeners.end());
+}
+
+void BufferCache::NotifyWrite(const SIZE_T blocknum)
+{
+  for (SIZE_T i=0;i<listeners.size();i++) { 
+    listeners[i].first(blocknum,listeners[i].second);
+  }
+}
+  
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  return PrefetchBlocks(vector<SIZE_T>(1,blocknum));
+}
+
+
+ERROR_T BufferCache::PrefetchBlocks(const vector<SIZE_T> &blocknums)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  vector<SIZE_T> wanted;
+
+  for (SIZE_T i=0;i<blocknums.size();i++) { 
+    if (blockmap.find(blocknums[i])==blockmap.end()) { 
+      wanted.push_back(blocknums[i]);
+    }
+  }
+  sort(wanted.begin(),wanted.end());
+  wanted.erase(unique(wanted.begin(),wanted.end()),wanted.end());
+
+  SIZE_T start=0;
+
+  while (start<wanted.size()) { 
+    SIZE_T count=1;
+    while (start+count<wanted.size() && wanted[start+count]==wanted[start]+count) { 
+      count++;
+    }
+
+    vector<Block> blocks;
+    double reqtime;
+    int rc=disk->Read(wanted[start],count,blocks,reqtime);
+    curtime+=reqtime;
+    diskreads+=count;
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+
+    // A prefetched block is not a read until someone asks for it
+    for (SIZE_T i=0;i<count;i++) { 
+      CheckDeleteOldest();
+      if (blockmap.size()>=cachesize) { 
+	return ERROR_NOFETCH;
+      }
+      blocks[i].lastaccessed=curtime;
+      blocks[i].dirty=false;
+      blockmap[wanted[start+i]]=blocks[i];
+    }
+    start+=count;
+  }
+  return ERROR_NOERROR;
 }
   
+ERROR_T BufferCache::FlushAll(const SIZE_T last)
+{
+  lock_guard<recursive_mutex> hold(lock);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator i;
+
+  // Everything but last, then last
+  for (int pass=0; pass<2; pass++) { 
+    for (i=blockmap.begin(); i!=blockmap.end(); ++i) { 
+      if ((*i).second.dirty && ((*i).first==last)==(pass==1)) { 
+	double reqtime;
+	int rc=disk->Write((*i).first,
+			   (*i).second,
+			   reqtime);
+	diskwrites++;
+	curtime+=reqtime;
+	if (rc!=ERROR_NOERROR) { 
+	  return rc;
+	}
+	(*i).second.dirty=false;
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  lock_guard<recursive_mutex> hold(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(blocknum);
@@ -223,14 +403,19 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
+      (*b).second.dirty=false;
+    }
+    // A pinned frame is now clean on disk, but it has to stay put
+    if ((*b).second.pincount==0) { 
+      blockmap.erase(b);
     }
-    blockmap.erase(b);
     return ERROR_NOERROR;
   }
 }
   
 ostream & BufferCache::Print(ostream &os) const
 {
+  lock_guard<recursive_mutex> hold(lock);
   os << "BufferCache(cachesize="<<cachesize
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
@@ -256,3 +441,41 @@ ostream & BufferCache::Print(ostream &os) const
   return os;
 }
   
+
+
+PinnedBlock::PinnedBlock(BufferCache *c) : 
+  cache(c), blocknum(0), frame(0), dirty(false)
+{}
+
+PinnedBlock::~PinnedBlock()
+{
+  Unpin();
+}
+
+ERROR_T PinnedBlock::Pin(const SIZE_T block)
+{
+  ERROR_T rc;
+
+  if ((rc=Unpin())!=ERROR_NOERROR) { 
+    return rc;
+  }
+  if ((rc=cache->PinBlock(block,frame))!=ERROR_NOERROR) { 
+    frame=0;
+    return rc;
+  }
+  blocknum=block;
+  dirty=false;
+  return ERROR_NOERROR;
+}
+
+ERROR_T PinnedBlock::Unpin()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (frame) { 
+    rc=cache->UnpinBlock(blocknum,dirty);
+    frame=0;
+    dirty=false;
+  }
+  return rc;
+}
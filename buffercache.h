@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
+#include <mutex>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +12,10 @@
 
 using namespace std;
 
+// Told the number of each block whose contents change through the
+// cache; see BufferCache::AddWriteListener
+typedef void (*BlockWriteFn)(const SIZE_T blocknum, void *arg);
+
 struct cache_compare_lessthan {
   bool operator()(const SIZE_T s1, const SIZE_T s2) const {
     return s1<s2;
@@ -22,6 +28,11 @@ struct cache_compare_lessthan {
 //
 // Write Back
 // Write Allocate
+//
+// Thread safe: each call has the cache to itself while it runs.  What
+// is in a pinned frame is not guarded by this, only by whatever the
+// callers agree on (BTreeIndex latches the nodes).  The counters are
+// read without the lock, so they may lag while other threads run.
 class BufferCache {
  private:
   DiskSystem *disk;
@@ -29,8 +40,13 @@ class BufferCache {
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  vector<pair<BlockWriteFn,void *> > listeners;
+  // Held for the length of every public call; listeners are called
+  // with it held
+  mutable recursive_mutex lock;
  protected:
   ERROR_T CheckDeleteOldest();
+  void    NotifyWrite(const SIZE_T blocknum);
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -51,6 +67,9 @@ class BufferCache {
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
   SIZE_T GetNumBlocks() const;
+  // Geometry of the underlying device, for placement decisions
+  SIZE_T GetNumHeads() const;
+  SIZE_T GetBlocksPerTrack() const;
   // Current time in the simulation (starts at zero)
   double GetCurrentTime() const;
 
@@ -61,6 +80,8 @@ class BufferCache {
   ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum);
   // check to see if we think the block was allocated
   bool  IsBlockAllocated(const SIZE_T inblocknum);
+  // check to see if a read of the block would not go to disk
+  bool  IsBlockCached(const SIZE_T inblocknum) const;
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
@@ -71,15 +92,40 @@ class BufferCache {
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
   
+  // Zero-copy access: PinBlock brings a block into the cache and
+  // hands back the cached frame itself, which stays put (it will not be
+  // evicted) until the matching UnpinBlock.  Pass dirty=true to
+  // UnpinBlock if the frame was modified in place.
+  ERROR_T PinBlock(const SIZE_T inblocknum, Block *&frame);
+  ERROR_T UnpinBlock(const SIZE_T inblocknum, const bool dirty=false);
+
+  // fn(blocknum,arg) is called whenever a block is written
+  // (WriteBlock, or UnpinBlock of a frame changed in place) or
+  // deallocated, for anyone who keeps something derived from the
+  // contents of blocks and has to drop it when they change
+  void    AddWriteListener(BlockWriteFn fn, void *arg);
+  void    RemoveWriteListener(BlockWriteFn fn, void *arg);
+
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
+
+  // The same for a set of blocks, in any order.  Those not already
+  // cached are read in ascending block order, with each run of
+  // consecutive blocks read as one request.  ERROR_NOFETCH if the
+  // cache filled up with pinned frames before all were read.
+  ERROR_T PrefetchBlocks(const vector<SIZE_T> &blocknums);
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  // Writes every dirty block to disk, in ascending order but for
+  // block last, which goes after all the others (a superblock that
+  // names them).  The blocks stay cached.
+  ERROR_T FlushAll(const SIZE_T last);
   
  
   SIZE_T GetNumAllocs() const { return allocs; }
@@ -97,4 +143,30 @@ class BufferCache {
 inline ostream & operator<< (ostream &os, const BufferCache &b) { return b.Print(os);}
 
 
+//
+// Holds a pin on one cached block for as long as it is in scope.
+// Call MarkDirty after changing the frame in place.
+//
+class PinnedBlock {
+ private:
+  BufferCache *cache;
+  SIZE_T       blocknum;
+  Block       *frame;
+  bool         dirty;
+
+  PinnedBlock(const PinnedBlock &rhs);
+  PinnedBlock & operator=(const PinnedBlock &rhs);
+ public:
+  PinnedBlock(BufferCache *cache);
+  ~PinnedBlock();
+
+  ERROR_T Pin(const SIZE_T blocknum);
+  ERROR_T Unpin();
+
+  void    MarkDirty() { dirty=true; }
+  Block & GetFrame() const { return *frame; }
+  SIZE_T  GetBlockNum() const { return blocknum; }
+};
+
+
 #endif
@@ -515,6 +515,16 @@ SIZE_T DiskSystem::GetNumBlocks() const
   return numblocks;
 }
 
+SIZE_T DiskSystem::GetNumHeads() const
+{
+  return numheads;
+}
+
+SIZE_T DiskSystem::GetBlocksPerTrack() const
+{
+  return blockspertrack;
+}
+
 
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
@@ -96,6 +96,8 @@ class DiskSystem {
 
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
+  SIZE_T GetNumHeads() const;
+  SIZE_T GetBlocksPerTrack() const;
 
   //
   // These are notification functions that should be called when
@@ -1,8 +1,8 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
+($#ARGV==3 || $#ARGV==4) or die "usage: gen_test_sequence.pl keysize valsize seed num [deletes]\n";
 
-($keysize,$valuesize,$seed,$num)=@ARGV;
+($keysize,$valuesize,$seed,$num,$deletes)=@ARGV;
 
 srand $seed;
 
@@ -13,16 +13,17 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required this quarter
-# 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
 	 DISPLAY => \&gen_display
        );
 
+# Deletes only if asked for, so that other sequences stay as they were
+if (defined $deletes && $deletes eq "deletes") { 
+  $ops{DELETE_NEW}=\&gen_delete_new;
+  $ops{DELETE_EXISTS}=\&gen_delete_exists;
+}
+
 @opnames=keys %ops;
 
 
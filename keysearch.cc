@@ -0,0 +1,294 @@
+#include <string.h>
+#include <time.h>
+
+#include "keysearch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEYSEARCH_X86 1
+#include <immintrin.h>
+#else
+#define KEYSEARCH_X86 0
+#endif
+
+typedef unsigned long long U64_T;
+
+// memcmp order on 8 bytes is numeric order of their big-endian value
+static inline U64_T LoadBE64(const char *p)
+{
+  U64_T x;
+  memcpy(&x,p,sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap64(x);
+#endif
+  return x;
+}
+
+
+static SIZE_T ScalarSearch8(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  U64_T p=LoadBE64(probe);
+  SIZE_T count=0;
+
+  for (SIZE_T i=0;i<n;i++) {
+    count += LoadBE64(base+i*stride)<p;
+  }
+  return count;
+}
+
+static SIZE_T ScalarSearch16(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  U64_T phi=LoadBE64(probe);
+  U64_T plo=LoadBE64(probe+8);
+  SIZE_T count=0;
+
+  for (SIZE_T i=0;i<n;i++) {
+    U64_T hi=LoadBE64(base+i*stride);
+    U64_T lo=LoadBE64(base+i*stride+8);
+    count += (hi<phi) | ((hi==phi) & (lo<plo));
+  }
+  return count;
+}
+
+
+#if KEYSEARCH_X86
+
+//
+// The SIMD compares are signed, so both sides get their sign bit
+// flipped first, which turns unsigned order into signed order
+//
+#define KEYSEARCH_SIGN ((long long)0x8000000000000000ULL)
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T Sse42Search8(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  const __m128i bswap=_mm_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+  const __m128i sign=_mm_set1_epi64x(KEYSEARCH_SIGN);
+  const __m128i p=_mm_xor_si128(_mm_set1_epi64x((long long)LoadBE64(probe)),sign);
+  SIZE_T count=0;
+  SIZE_T i=0;
+
+  for (;i+2<=n;i+=2) {
+    __m128i k=_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(base+i*stride)),
+				 _mm_loadl_epi64((const __m128i *)(base+(i+1)*stride)));
+    k=_mm_xor_si128(_mm_shuffle_epi8(k,bswap),sign);
+    count+=__builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(p,k))));
+  }
+  return count + ScalarSearch8(base+i*stride,stride,n-i,probe);
+}
+
+__attribute__((target("sse4.2")))
+static SIZE_T Sse42Search16(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  const __m128i bswap=_mm_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+  const __m128i sign=_mm_set1_epi64x(KEYSEARCH_SIGN);
+  const __m128i phi=_mm_xor_si128(_mm_set1_epi64x((long long)LoadBE64(probe)),sign);
+  const __m128i plo=_mm_xor_si128(_mm_set1_epi64x((long long)LoadBE64(probe+8)),sign);
+  SIZE_T count=0;
+  SIZE_T i=0;
+
+  for (;i+2<=n;i+=2) {
+    __m128i k0=_mm_loadu_si128((const __m128i *)(base+i*stride));
+    __m128i k1=_mm_loadu_si128((const __m128i *)(base+(i+1)*stride));
+    __m128i hi=_mm_xor_si128(_mm_shuffle_epi8(_mm_unpacklo_epi64(k0,k1),bswap),sign);
+    __m128i lo=_mm_xor_si128(_mm_shuffle_epi8(_mm_unpackhi_epi64(k0,k1),bswap),sign);
+    __m128i lt=_mm_or_si128(_mm_cmpgt_epi64(phi,hi),
+			    _mm_and_si128(_mm_cmpeq_epi64(phi,hi),_mm_cmpgt_epi64(plo,lo)));
+    count+=__builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+  }
+  return count + ScalarSearch16(base+i*stride,stride,n-i,probe);
+}
+
+
+//
+// The AVX2 kernels load four keys with plain loads: one 32 byte load
+// when 8 byte keys are packed together, otherwise a load per key put
+// together in registers.  (A gather is no faster than the four loads
+// it stands for on most cores, and slower on some.)  Lanes only need
+// to hold the right keys, not in order, since all that is kept is how
+// many compare lower.
+//
+
+__attribute__((target("avx2")))
+static SIZE_T Avx2Search8(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  const __m256i bswap=_mm256_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7,
+				      8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+  const __m256i sign=_mm256_set1_epi64x(KEYSEARCH_SIGN);
+  const __m256i p=_mm256_xor_si256(_mm256_set1_epi64x((long long)LoadBE64(probe)),sign);
+  SIZE_T count=0;
+  SIZE_T i=0;
+
+  for (;i+4<=n;i+=4) {
+    const char *b=base+i*stride;
+    __m256i k;
+    if (stride==8) {
+      k=_mm256_loadu_si256((const __m256i *)b);
+    } else {
+      __m128i k01=_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)b),
+				     _mm_loadl_epi64((const __m128i *)(b+stride)));
+      __m128i k23=_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(b+2*stride)),
+				     _mm_loadl_epi64((const __m128i *)(b+3*stride)));
+      k=_mm256_inserti128_si256(_mm256_castsi128_si256(k01),k23,1);
+    }
+    k=_mm256_xor_si256(_mm256_shuffle_epi8(k,bswap),sign);
+    count+=__builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(p,k))));
+  }
+  return count + ScalarSearch8(base+i*stride,stride,n-i,probe);
+}
+
+__attribute__((target("avx2")))
+static SIZE_T Avx2Search16(const char *base, const SIZE_T stride, const SIZE_T n, const char *probe)
+{
+  const __m256i bswap=_mm256_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7,
+				      8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+  const __m256i sign=_mm256_set1_epi64x(KEYSEARCH_SIGN);
+  const __m256i phi=_mm256_xor_si256(_mm256_set1_epi64x((long long)LoadBE64(probe)),sign);
+  const __m256i plo=_mm256_xor_si256(_mm256_set1_epi64x((long long)LoadBE64(probe+8)),sign);
+  SIZE_T count=0;
+  SIZE_T i=0;
+
+  for (;i+4<=n;i+=4) {
+    const char *b=base+i*stride;
+    __m256i k01, k23;
+    // Two whole keys to a register, then their halves sorted out
+    if (stride==16) {
+      k01=_mm256_loadu_si256((const __m256i *)b);
+      k23=_mm256_loadu_si256((const __m256i *)(b+32));
+    } else {
+      k01=_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)b)),
+				  _mm_loadu_si128((const __m128i *)(b+stride)),1);
+      k23=_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(b+2*stride))),
+				  _mm_loadu_si128((const __m128i *)(b+3*stride)),1);
+    }
+    __m256i hi=_mm256_xor_si256(_mm256_shuffle_epi8(_mm256_unpacklo_epi64(k01,k23),bswap),sign);
+    __m256i lo=_mm256_xor_si256(_mm256_shuffle_epi8(_mm256_unpackhi_epi64(k01,k23),bswap),sign);
+    __m256i lt=_mm256_or_si256(_mm256_cmpgt_epi64(phi,hi),
+			       _mm256_and_si256(_mm256_cmpeq_epi64(phi,hi),_mm256_cmpgt_epi64(plo,lo)));
+    count+=__builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+  }
+  return count + ScalarSearch16(base+i*stride,stride,n-i,probe);
+}
+
+#endif
+
+
+static bool CanRun(const KeySearchImpl impl)
+{
+  switch (impl) {
+  case KEYSEARCH_SCALAR:
+    return true;
+#if KEYSEARCH_X86
+  case KEYSEARCH_SSE42:
+    return __builtin_cpu_supports("sse4.2");
+  case KEYSEARCH_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec*1e9+t.tv_nsec;
+}
+
+// Times each kernel this CPU can run for keysize, on a window of keys
+// laid out as in a leaf with values as long as the keys, and returns
+// the fastest.  Each is timed several times, turn about with the
+// others, and its best time kept, so that a spell of noise does not
+// decide it.
+static KeySearchImpl Calibrate(const SIZE_T keysize)
+{
+  const KeySearchImpl impls[] = {KEYSEARCH_SCALAR, KEYSEARCH_SSE42, KEYSEARCH_AVX2};
+  const SIZE_T numimpls=sizeof(impls)/sizeof(impls[0]);
+  const SIZE_T stride=2*keysize;
+  char keys[KEYSEARCH_LINEAR_WINDOW*32];
+  char probes[2*KEYSEARCH_LINEAR_WINDOW+1][16];
+  double best[numimpls];
+  volatile SIZE_T sink=0;
+
+  memset(keys,0,sizeof(keys));
+  memset(probes,0,sizeof(probes));
+  // Keys 1, 3, 5, ... in their last byte; probes on and between them
+  for (SIZE_T i=0;i<KEYSEARCH_LINEAR_WINDOW;i++) {
+    keys[i*stride+keysize-1]=(char)(2*i+1);
+  }
+  for (SIZE_T i=0;i<2*KEYSEARCH_LINEAR_WINDOW+1;i++) {
+    probes[i][keysize-1]=(char)i;
+  }
+
+  for (SIZE_T j=0;j<numimpls;j++) {
+    best[j]=-1;
+  }
+  for (SIZE_T round=0;round<KEYSEARCH_CALIBRATE_ROUNDS;round++) {
+    for (SIZE_T j=0;j<numimpls;j++) {
+      KeySearchFn kernel=GetKeySearchKernel(keysize,impls[j]);
+      if (!kernel) {
+	continue;
+      }
+      double start=Now();
+      for (SIZE_T p=0;p<KEYSEARCH_CALIBRATE_PROBES;p++) {
+	sink+=kernel(keys,stride,KEYSEARCH_LINEAR_WINDOW,probes[p%(2*KEYSEARCH_LINEAR_WINDOW+1)]);
+      }
+      double t=Now()-start;
+      if (best[j]<0 || t<best[j]) {
+	best[j]=t;
+      }
+    }
+  }
+
+  SIZE_T fastest=0;
+  for (SIZE_T j=1;j<numimpls;j++) {
+    if (best[j]>=0 && best[j]<best[fastest]) {
+      fastest=j;
+    }
+  }
+  return impls[fastest];
+}
+
+
+KeySearchImpl GetBestKeySearchImpl(const SIZE_T keysize)
+{
+  if (keysize==16) {
+    static KeySearchImpl best16=Calibrate(16);
+    return best16;
+  }
+  static KeySearchImpl best8=Calibrate(8);
+  return best8;
+}
+
+
+KeySearchFn GetKeySearchKernel(const SIZE_T keysize, const KeySearchImpl which)
+{
+  KeySearchImpl impl = which==KEYSEARCH_BEST ? GetBestKeySearchImpl(keysize) : which;
+
+  if (!CanRun(impl)) {
+    return 0;
+  }
+
+  switch (impl) {
+  case KEYSEARCH_SCALAR:
+    return keysize==8 ? ScalarSearch8 : keysize==16 ? ScalarSearch16 : 0;
+#if KEYSEARCH_X86
+  case KEYSEARCH_SSE42:
+    return keysize==8 ? Sse42Search8 : keysize==16 ? Sse42Search16 : 0;
+  case KEYSEARCH_AVX2:
+    return keysize==8 ? Avx2Search8 : keysize==16 ? Avx2Search16 : 0;
+#endif
+  default:
+    return 0;
+  }
+}
+
+
+const char *KeySearchImplName(const KeySearchImpl impl)
+{
+  return impl==KEYSEARCH_SCALAR ? "scalar" :
+         impl==KEYSEARCH_SSE42 ? "sse4.2" :
+         impl==KEYSEARCH_AVX2 ? "avx2" : "best";
+}
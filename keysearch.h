@@ -0,0 +1,50 @@
+#ifndef _keysearch
+#define _keysearch
+
+#include "global.h"
+
+//
+// Vectorized in-node key search for fixed 8 and 16 byte keys.
+//
+// A kernel counts how many of n sorted keys, stored stride bytes
+// apart starting at base, compare (as memcmp would) strictly less
+// than probe.  For a sorted run that count is the lower bound of
+// probe, so node search narrows the range by binary search and then
+// hands the last few slots to a kernel.
+//
+// Keys are compared as big-endian unsigned integers, which orders
+// them exactly like memcmp.  There are scalar, SSE4.2 and AVX2
+// kernels; which is used is decided at runtime by timing those the
+// CPU supports against each other, since which is fastest depends on
+// the core and on how the library was compiled.
+//
+
+typedef SIZE_T (*KeySearchFn)(const char *base,
+			      const SIZE_T stride,
+			      const SIZE_T n,
+			      const char *probe);
+
+enum KeySearchImpl {KEYSEARCH_SCALAR, KEYSEARCH_SSE42, KEYSEARCH_AVX2, KEYSEARCH_BEST};
+
+// Once binary search has narrowed a node to this many slots, the
+// rest of the search is done with a kernel
+#define KEYSEARCH_LINEAR_WINDOW 16
+
+// How the kernels are timed against each other: each does this many
+// probes, this many times over
+#define KEYSEARCH_CALIBRATE_PROBES 2000
+#define KEYSEARCH_CALIBRATE_ROUNDS 5
+
+// The kernel for this key size, or 0 if there is none.
+// KEYSEARCH_BEST picks the one that timed fastest on this machine.
+// Asking for an implementation the CPU cannot run also returns 0.
+KeySearchFn GetKeySearchKernel(const SIZE_T keysize,
+			       const KeySearchImpl impl=KEYSEARCH_BEST);
+
+// What KEYSEARCH_BEST resolves to on this machine for this key size;
+// the kernels are timed the first time this is called
+KeySearchImpl GetBestKeySearchImpl(const SIZE_T keysize);
+
+const char *KeySearchImplName(const KeySearchImpl impl);
+
+#endif
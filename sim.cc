@@ -14,6 +14,76 @@ void usage()
   cerr << "usage: sim filestem cachesize < specfile \n";
 }
 
+// Consecutive LOOKUPs, INSERTs or UPDATEs are done together, this
+// many at most
+#define SIM_BATCH 1024
+
+// Does a held-back run of one of those operations as one batch, then
+// replies to each in order, just as if they had been done one by one
+static void FlushBatch(BTreeIndex *btree, const string &action,
+		       vector<pair<string,string> > &batch)
+{
+  vector<ERROR_T> replies(batch.size());
+  vector<SIZE_T> slot(batch.size());
+  vector<KeyValuePair> pairs;
+  vector<KEY_T> keys;
+  vector<VALUE_T> values;
+  vector<ERROR_T> results;
+  ERROR_T rc;
+
+  // A key that does not parse fails without going into the batch
+  for (unsigned int i=0; i<batch.size(); i++) {
+    KEY_T k;
+    if ((replies[i]=btree->ParseKey(batch[i].first.c_str(),k))) {
+      continue;
+    }
+    slot[i]=pairs.size();
+    pairs.push_back(KeyValuePair(k,VALUE_T(batch[i].second.c_str())));
+    keys.push_back(k);
+  }
+
+  if (action == "LOOKUP") {
+    rc=btree->MultiGet(keys,values,results);
+  } else if (action == "INSERT") {
+    rc=btree->InsertBatch(pairs,results);
+  } else {
+    rc=btree->UpdateBatch(pairs,results);
+  }
+  if (rc) {
+    results.assign(pairs.size(),rc);
+  }
+
+  for (unsigned int i=0; i<batch.size(); i++) {
+    if ((rc = replies[i] ? replies[i] : results[slot[i]])) {
+      cout <<"FAIL"<< endl;
+      cerr <<"Can't "<<(action=="LOOKUP" ? "lookup" : action=="INSERT" ? "insert" : "update")
+	   <<" due to error "<<rc<<endl;
+    } else if (action == "LOOKUP") {
+      cout <<"OK ";
+      for (unsigned int k=0; k<values[slot[i]].length; k++) {
+	cout << values[slot[i]].data[k];
+      }
+      cout << endl;
+    } else {
+      cout <<"OK\n";
+    }
+  }
+  batch.clear();
+}
+
+// Prints each pair a SCAN finds the way DISPLAY prints it
+static ERROR_T PrintPair(const KEY_T &key, const VALUE_T &value, void *arg)
+{
+  cout << "(";
+  ((BTreeIndex *)arg)->PrintKey(cout,key);
+  cout << ",";
+  for (unsigned int i=0; i<value.length; i++) {
+    cout << value.data[i];
+  }
+  cout << ")\n";
+  return ERROR_NOERROR;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -41,6 +111,8 @@ int main(int argc, char *argv[])
   BufferCache cache(&disk,cachesize);
   // will be set on init
   BTreeIndex *btree;
+  string batchaction;
+  vector<pair<string,string> > batch;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -54,51 +126,62 @@ int main(int argc, char *argv[])
   while (fgets(line, max, file) != NULL){
     // foreach line read we will refer to a case switch statement
     string line2, action, key, value;
+    KEY_T k;
     line2 = line;
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
 
+    // Hold LOOKUPs, INSERTs and UPDATEs back to do a run of one of
+    // them together; anything else does the run first, so replies
+    // still come out in order
+    if (!batch.empty() && (action!=batchaction || batch.size()>=SIM_BATCH)) {
+      FlushBatch(btree,batchaction,batch);
+    }
+    if (action == "LOOKUP" || action == "INSERT" || action == "UPDATE") {
+      batchaction=action;
+      batch.push_back(make_pair(key,value));
+      continue;
+    }
+
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
+      // INIT keysize valuesize [option ...]
+      string option;
+      SIZE_T options=0;
+      bool badoption=false;
+      while (is >> option && option[0]!='#') {
+	if (GetIndexOption(option)==0) {
+	  cerr << "Unknown index option "<<option<<"\n";
+	  badoption=true;
+	}
+	options|=GetIndexOption(option);
+      }
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,options);
+      if (badoption) {
+	cout << "FAIL\n";
+      } else if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
       } else {
 	cout << "OK\n";
       }
-    } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't insert due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
-      }
-    } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL" <<endl;
-	cerr <<"Can't update due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
-      }
     } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
+      if ((rc=btree->ParseKey(key.c_str(),k)) || (rc=btree->Delete(k))) { 
         cout <<"FAIL"<<endl;
 	cerr <<"Can't delete due to error "<<rc<<endl;
       } else {
         cout <<"OK\n";
       }
-    } else if (action == "LOOKUP"){
-      VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<< endl;
-	cerr <<"Can't lookup due to error "<<rc<<endl;
-      } else {
-        cout <<"OK ";
- 	for (unsigned int k=0; k<lookup_value.length; k++) {
- 	    cout << lookup_value.data[k];
-	}
- 	cout << endl;
+    } else if (action == "SCAN") {
+      // SCAN lo hi [limit]
+      KEY_T hi;
+      SIZE_T limit=0;
+      is >> limit;
+      cout <<"OK BEGIN SCAN\n";
+      if ((rc=btree->ParseKey(key.c_str(),k)) || (rc=btree->ParseKey(value.c_str(),hi)) ||
+	  (rc=btree->Scan(k,hi,limit,PrintPair,btree))) { 
+	cerr <<"Can't scan due to error "<<rc<<endl;
       }
+      cout <<"OK END SCAN\n";
     } else if (action == "DISPLAY") {
       // This should always be OK
       cout <<"OK BEGIN DISPLAY\n";
@@ -119,6 +202,9 @@ int main(int argc, char *argv[])
       }
     }
   }
+  if (!batch.empty()) {
+    FlushBatch(btree,batchaction,batch);
+  }
     
   fclose(file);
 